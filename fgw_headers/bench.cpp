@@ -0,0 +1,556 @@
+// bench.cpp - timing harness for the playpen library.
+// Built and run by the bench target of the makefiles. Results are written
+// to stdout as JSON so that runs from before and after a change can be
+// compared case by case.
+//
+// usage: bench [--samples n] [--size w h] [--window] [name-filter ...]
+//	--samples n	number of timed samples per case (default 15)
+//	--size w h	canvas size in pixels (default 512 by 512); the parallel
+//				fill and save cases only use their threads from 1024 by
+//				512 up
+//	--window	draw to a real window; by default the playpen is headless
+//				and display() stops short of converting pixels
+//	name-filter	only run cases whose name contains one of these strings
+
+#include "playpen.h"
+#include "line_drawing.h"
+#include "flood_fill.h"
+#include "shape.h"
+#include "minipng.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace fgw;
+
+namespace {
+	int const default_samples(15);
+	double const min_sample_seconds(0.002);
+	long const max_iterations(1L << 22);
+	char const png_file[] = "playpen_bench.png";
+
+	hue const wall(black);
+	hue const fill_a(red4);
+	hue const fill_b(green4);
+
+	// Logical coordinates used by the cases: (0, 0) is the bottom left raw
+	// pixel and one logical pixel is one raw pixel unless a case says not.
+	void reset(playpen & p, hue background = white){
+		p.scale(1);
+		p.origin(0, p.height() - 1);
+		p.setplotmode(direct);
+		p.clear(background);
+	}
+
+	int count_hue(playpen const & p, hue h){
+		int n(0);
+		for(int y(0); y != p.height(); ++y){
+			for(int x(0); x != p.width(); ++x){
+				if(p.getrawpixel(x, y) == h) ++n;
+			}
+		}
+		return n;
+	}
+
+	// xorshift keeps the point sequence identical from run to run
+	unsigned long random_state(2463534242UL);
+	unsigned long next_random(){
+		random_state ^= (random_state << 13) & 0xffffffffUL;
+		random_state ^= random_state >> 17;
+		random_state ^= (random_state << 5) & 0xffffffffUL;
+		return random_state;
+	}
+
+	std::vector<playpen::point> points;
+	int point_index(0);
+	int alternate(0);
+
+	hue next_fill(){
+		return (++alternate & 1) ? fill_a : fill_b;
+	}
+
+// plot
+	double setup_points(playpen & p, plotmode mode, int scale){
+		reset(p);
+		p.scale(scale);
+		p.setplotmode(mode);
+		points.resize(4096);
+		for(unsigned i(0); i != points.size(); ++i){
+			points[i].x = int(next_random() % (p.width() / scale));
+			points[i].y = int(next_random() % (p.height() / scale));
+		}
+		point_index = 0;
+		return double(scale) * scale;
+	}
+	double setup_plot_direct1(playpen & p){ return setup_points(p, direct, 1); }
+	double setup_plot_direct2(playpen & p){ return setup_points(p, direct, 2); }
+	double setup_plot_direct4(playpen & p){ return setup_points(p, direct, 4); }
+	double setup_plot_additive1(playpen & p){ return setup_points(p, additive, 1); }
+	double setup_plot_additive2(playpen & p){ return setup_points(p, additive, 2); }
+	double setup_plot_additive4(playpen & p){ return setup_points(p, additive, 4); }
+	double setup_plot_filter1(playpen & p){ return setup_points(p, filter, 1); }
+	double setup_plot_filter2(playpen & p){ return setup_points(p, filter, 2); }
+	double setup_plot_filter4(playpen & p){ return setup_points(p, filter, 4); }
+	double setup_plot_disjoint1(playpen & p){ return setup_points(p, disjoint, 1); }
+	double setup_plot_disjoint2(playpen & p){ return setup_points(p, disjoint, 2); }
+	double setup_plot_disjoint4(playpen & p){ return setup_points(p, disjoint, 4); }
+
+	void run_plot(playpen & p){
+		playpen::point const & pt(points[point_index]);
+		point_index = (point_index + 1) & 4095;
+		p.plot(pt.x, pt.y, hue(point_index));
+	}
+
+// spans and rectangles
+	double setup_plain(playpen & p){
+		reset(p);
+		return 0;
+	}
+	double setup_span(playpen & p){
+		setup_plain(p);
+		return 256;
+	}
+	void run_span(playpen & p){
+		p.plot_span(128, (++alternate) & 255, 256, next_fill());
+	}
+	double setup_fill_rect(playpen & p){
+		setup_plain(p);
+		return double(p.width()) * p.height();
+	}
+	void run_fill_rect(playpen & p){
+		p.fill_rect(0, 0, p.width(), p.height(), next_fill());
+	}
+
+// drawline
+	int line_dx(0);
+	int line_dy(0);
+	double setup_line(playpen & p, int dx, int dy){
+		setup_plain(p);
+		line_dx = dx;
+		line_dy = dy;
+		return std::max(dx, dy);
+	}
+	double setup_line_short(playpen & p){ return setup_line(p, 10, 4); }
+	double setup_line_long(playpen & p){ return setup_line(p, p.width() - 1, p.height() / 3); }
+	double setup_line_steep(playpen & p){ return setup_line(p, 7, p.height() - 1); }
+	void run_line(playpen & p){
+		int const x(int(next_random() % (p.width() - line_dx)));
+		int const y(int(next_random() % (p.height() - line_dy)));
+		drawline(p, x, y, x + line_dx, y + line_dy, next_fill());
+	}
+	// 200000 pixels long, of which only about the width is on the canvas
+	double setup_line_offscreen(playpen & p){
+		setup_plain(p);
+		return p.width();
+	}
+	void run_line_offscreen(playpen & p){
+		int const y(int(next_random() % p.height()));
+		drawline(p, -100000, y - 400, 100000, y + 400, next_fill());
+	}
+	void run_line_functor(playpen & p){
+		int const x(int(next_random() % (p.width() - line_dx)));
+		int const y(int(next_random() % (p.height() - line_dy)));
+		drawline(p, x, y, x + line_dx, y + line_dy, next_fill(), plot_pixel());
+	}
+
+// polylines: a 100000 point random walk across the canvas, the kind of
+// time series a chart plots
+	std::vector<point2d> series;
+	double setup_series(playpen & p){
+		setup_plain(p);
+		int const n(100000);
+		series.resize(n);
+		double y(p.height() / 2);
+		for(int i(0); i != n; ++i){
+			y += int(next_random() % 9) - 4;
+			if(y < 0) y = 0;
+			if(y >= p.height()) y = p.height() - 1;
+			series[i] = point2d(double(i) * (p.width() - 1) / (n - 1), y);
+		}
+		return n * sizeof(point2d);
+	}
+	void run_polyline(playpen & p){
+		drawpolyline(p, &series[0], int(series.size()), next_fill());
+	}
+	void run_shape_lines(playpen & p){
+		hue const shade(next_fill());
+		for(unsigned i(0); i + 1 < series.size(); ++i){
+			drawline(p, series[i], series[i + 1], shade);
+		}
+	}
+
+// scatter plot markers: small circles at random places, measured against
+// the pixels in one filled marker
+	double setup_markers(playpen & p){
+		setup_points(p, direct, 1);
+		fill_circle(p, p.width() / 2, p.height() / 2, 3, fill_b);
+		double const bytes(count_hue(p, fill_b));
+		p.clear(white);
+		return bytes;
+	}
+	void run_draw_circle(playpen & p){
+		playpen::point const & pt(points[point_index]);
+		point_index = (point_index + 1) & 4095;
+		draw_circle(p, pt.x, pt.y, 3, next_fill());
+	}
+	void run_fill_circle(playpen & p){
+		playpen::point const & pt(points[point_index]);
+		point_index = (point_index + 1) & 4095;
+		fill_circle(p, pt.x, pt.y, 3, next_fill());
+	}
+	void run_makecircle(playpen & p){
+		playpen::point const & pt(points[point_index]);
+		point_index = (point_index + 1) & 4095;
+		drawshape(p, makecircle(3, point2d(pt.x, pt.y)), next_fill());
+	}
+
+// flood fills
+	// A bordered box: every row of the fill is a single long span.
+	void draw_box(playpen & p){
+		reset(p);
+		p.fill_rect(8, 8, p.width() - 16, 1, wall);
+		p.fill_rect(8, p.height() - 9, p.width() - 16, 1, wall);
+		p.fill_rect(8, 8, 1, p.height() - 16, wall);
+		p.fill_rect(p.width() - 9, 8, 1, p.height() - 16, wall);
+	}
+
+	// Horizontal walls three pixels apart with the gap at alternate ends,
+	// crossed by short stubs, so that the fill has to snake through a long
+	// corridor and keeps pushing and popping short runs.
+	void draw_maze(playpen & p){
+		draw_box(p);
+		int row(0);
+		for(int y(12); y < p.height() - 12; y += 4, ++row){
+			int const left((row & 1) ? 9 : 17);
+			p.fill_rect(left, y, p.width() - 26, 1, wall);
+			for(int x(24 + (row & 1) * 8); x < p.width() - 24; x += 16){
+				p.fill_rect(x, y + 1, 1, 2, wall);
+			}
+		}
+	}
+
+	double setup_fill_region(playpen & p, void (*draw)(playpen &)){
+		draw(p);
+		alternate = 0;
+		seed_fill(p, p.width() / 2, 10, fill_b, wall);
+		return count_hue(p, fill_b);
+	}
+	double setup_seed_box(playpen & p){ return setup_fill_region(p, draw_box); }
+	double setup_seed_maze(playpen & p){ return setup_fill_region(p, draw_maze); }
+	void run_seed_fill(playpen & p){
+		seed_fill(p, p.width() / 2, 10, next_fill(), wall);
+	}
+	void run_replace_hue(playpen & p){
+		replace_hue(p, p.width() / 2, 10, next_fill());
+	}
+	void run_seed_fill_threads(playpen & p){
+		SetFillThreads(0);
+		run_seed_fill(p);
+		SetFillThreads(1);
+	}
+
+// filled_polygon
+	shape polygon;
+	double setup_polygon(playpen & p){
+		setup_plain(p);
+		double const radius(std::min(p.width(), p.height()) / 2 - 8);
+		polygon = make_regular_polygon(radius, 64);
+		moveshape(polygon, point2d(p.width() / 2, p.height() / 2));
+		filled_polygon(p, polygon, fill_b);
+		return count_hue(p, fill_b);
+	}
+	void run_polygon(playpen & p){
+		filled_polygon(p, polygon, next_fill());
+	}
+
+// a map of 1024 small hexagons tiling most of the canvas
+	std::vector<shape> cells;
+	double setup_map(playpen & p){
+		setup_plain(p);
+		cells.clear();
+		for(int row(0); row != 32; ++row){
+			for(int col(0); col != 32; ++col){
+				shape cell(make_regular_polygon(8, 6));
+				moveshape(cell, point2d(16 + col * 15 + (row & 1) * 7.5, 16 + row * 15));
+				cells.push_back(cell);
+			}
+		}
+		for(unsigned i(0); i != cells.size(); ++i){
+			filled_polygon(p, cells[i], fill_b, even_odd);
+		}
+		return count_hue(p, fill_b);
+	}
+	void run_map(playpen & p){
+		for(unsigned i(0); i != cells.size(); ++i){
+			filled_polygon(p, cells[i], hue(int(i)), even_odd);
+		}
+	}
+
+// recolouring the map, as a mouse hover highlighting one category would
+	int hover;
+	unsigned char swap_pairs[256];
+	double setup_recolour(playpen & p){
+		setup_map(p);
+		run_map(p);
+		hover = 0;
+		for(int i(0); i != 256; ++i) swap_pairs[i] = (unsigned char)(i ^ 1);
+		return double(p.width()) * p.height();
+	}
+	void run_replace_all(playpen & p){
+		p.replace_all(hue(hover), hue(hover ^ 1));
+		hover = (hover + 1) & 255;
+	}
+	void run_remap(playpen & p){
+		p.remap(swap_pairs);
+	}
+
+// labelling every region of the recoloured map
+	std::vector<unsigned> labels;
+	std::vector<playpen::region> regions;
+	void run_label4(playpen & p){
+		label_regions(p, labels, regions, four_connected);
+	}
+	void run_label8(playpen & p){
+		label_regions(p, labels, regions, eight_connected);
+	}
+
+// PNG
+	double setup_save(playpen & p){
+		draw_maze(p);
+		p.rgbpalette();
+		return double(p.width()) * p.height();
+	}
+	void run_save(playpen & p){
+		SavePlaypen(p, png_file);
+	}
+	double setup_load(playpen & p){
+		double const bytes(setup_save(p));
+		SavePlaypen(p, png_file);
+		return bytes;
+	}
+	void run_load(playpen & p){
+		LoadPlaypen(p, png_file);
+	}
+	// Rings of slowly changing hue, where filtering pays.
+	double setup_shaded(playpen & p){
+		int const cx(p.width() / 3), cy(p.height() / 2);
+		for(int y(0); y < p.height(); ++y){
+			for(int x(0); x < p.width(); ++x){
+				int const r2((x - cx) * (x - cx) + (y - cy) * (y - cy));
+				p.setrawpixel(x, y, hue((r2 >> 7) + x / 64));
+			}
+		}
+		p.rgbpalette();
+		return double(p.width()) * p.height();
+	}
+	void run_save_fast(playpen & p){
+		SavePlaypen(p, png_file, png_fast);
+	}
+	void run_save_small(playpen & p){
+		SavePlaypen(p, png_file, png_small);
+	}
+	void run_save_threads(playpen & p){
+		SavePlaypen(p, png_file, png_default, 0);
+	}
+	double setup_load_shaded(playpen & p){
+		double const bytes(setup_shaded(p));
+		SavePlaypen(p, png_file);
+		return bytes;
+	}
+
+// display
+	// When headless this measures the dirty tracking alone; --window adds
+	// the conversion and upload of the whole canvas.
+	double setup_display(playpen & p){
+		setup_plain(p);
+		p.display();
+		return double(p.width()) * p.height();
+	}
+	void run_display_full(playpen & p){
+		p.fill_rect(0, 0, p.width(), p.height(), next_fill());
+		p.display();
+	}
+	double setup_display_small(playpen & p){
+		setup_display(p);
+		return 32.0 * 32;
+	}
+	void run_display_small(playpen & p){
+		p.fill_rect(p.width() / 2, p.height() / 2, 32, 32, next_fill());
+		p.display();
+	}
+	double setup_display_clean(playpen & p){
+		setup_display(p);
+		return 0;
+	}
+	void run_display_clean(playpen & p){
+		p.display();
+	}
+
+	struct benchmark {
+		char const * name;
+		double (*setup)(playpen &);	// returns the bytes touched by one run
+		void (*run)(playpen &);
+	};
+
+	benchmark const benchmarks[] = {
+		{"plot/direct/scale1", setup_plot_direct1, run_plot},
+		{"plot/direct/scale2", setup_plot_direct2, run_plot},
+		{"plot/direct/scale4", setup_plot_direct4, run_plot},
+		{"plot/additive/scale1", setup_plot_additive1, run_plot},
+		{"plot/additive/scale2", setup_plot_additive2, run_plot},
+		{"plot/additive/scale4", setup_plot_additive4, run_plot},
+		{"plot/filter/scale1", setup_plot_filter1, run_plot},
+		{"plot/filter/scale2", setup_plot_filter2, run_plot},
+		{"plot/filter/scale4", setup_plot_filter4, run_plot},
+		{"plot/disjoint/scale1", setup_plot_disjoint1, run_plot},
+		{"plot/disjoint/scale2", setup_plot_disjoint2, run_plot},
+		{"plot/disjoint/scale4", setup_plot_disjoint4, run_plot},
+		{"plot_span/256", setup_span, run_span},
+		{"fill_rect/full", setup_fill_rect, run_fill_rect},
+		{"drawline/short", setup_line_short, run_line},
+		{"drawline/long", setup_line_long, run_line},
+		{"drawline/steep", setup_line_steep, run_line},
+		{"drawline/long/functor", setup_line_long, run_line_functor},
+		{"drawline/offscreen", setup_line_offscreen, run_line_offscreen},
+		{"drawpolyline/100k", setup_series, run_polyline},
+		{"drawline/100k", setup_series, run_shape_lines},
+		{"draw_circle/r3", setup_markers, run_draw_circle},
+		{"fill_circle/r3", setup_markers, run_fill_circle},
+		{"makecircle/r3", setup_markers, run_makecircle},
+		{"seed_fill/simple", setup_seed_box, run_seed_fill},
+		{"seed_fill/maze", setup_seed_maze, run_seed_fill},
+		{"replace_hue/simple", setup_seed_box, run_replace_hue},
+		{"replace_hue/maze", setup_seed_maze, run_replace_hue},
+		{"seed_fill/simple/threads", setup_seed_box, run_seed_fill_threads},
+		{"seed_fill/maze/threads", setup_seed_maze, run_seed_fill_threads},
+		{"filled_polygon/64gon", setup_polygon, run_polygon},
+		{"filled_polygon/map1024", setup_map, run_map},
+		{"replace_all/map1024", setup_recolour, run_replace_all},
+		{"remap/map1024", setup_recolour, run_remap},
+		{"label_regions/map1024/4", setup_recolour, run_label4},
+		{"label_regions/map1024/8", setup_recolour, run_label8},
+		{"SavePlaypen/maze", setup_save, run_save},
+		{"LoadPlaypen/maze", setup_load, run_load},
+		{"SavePlaypen/shaded/fast", setup_shaded, run_save_fast},
+		{"SavePlaypen/shaded", setup_shaded, run_save},
+		{"SavePlaypen/shaded/small", setup_shaded, run_save_small},
+		{"SavePlaypen/shaded/threads", setup_shaded, run_save_threads},
+		{"LoadPlaypen/shaded", setup_load_shaded, run_load},
+		{"display/full", setup_display, run_display_full},
+		{"display/small", setup_display_small, run_display_small},
+		{"display/clean", setup_display_clean, run_display_clean},
+	};
+
+	struct result {
+		long ops;
+		double ns_per_op;
+		double mb_per_s;
+		double p50, p90, p99;
+	};
+
+	double percentile(std::vector<double> const & sorted, double fraction){
+		std::vector<double>::size_type const rank(
+			std::vector<double>::size_type(fraction * (sorted.size() - 1) + 0.5));
+		return sorted[rank];
+	}
+
+	double time_runs(benchmark const & b, playpen & p, long iterations){
+		double const start(MonotonicTime());
+		for(long i(0); i != iterations; ++i){
+			b.run(p);
+		}
+		return MonotonicTime() - start;
+	}
+
+	result measure(benchmark const & b, playpen & p, int samples){
+		double const bytes(b.setup(p));
+		// double the batch until one sample is long enough to time reliably
+		long iterations(1);
+		while(time_runs(b, p, iterations) < min_sample_seconds
+			and iterations < max_iterations){
+			iterations *= 2;
+		}
+		std::vector<double> per_op;
+		double total(0);
+		for(int s(0); s != samples; ++s){
+			double const seconds(time_runs(b, p, iterations));
+			total += seconds;
+			per_op.push_back(seconds * 1e9 / iterations);
+		}
+		std::sort(per_op.begin(), per_op.end());
+		result r;
+		r.ops = iterations * samples;
+		r.ns_per_op = total * 1e9 / r.ops;
+		r.mb_per_s = total > 0 ? bytes * r.ops / total / 1e6 : 0;
+		r.p50 = percentile(per_op, 0.50);
+		r.p90 = percentile(per_op, 0.90);
+		r.p99 = percentile(per_op, 0.99);
+		return r;
+	}
+
+	bool selected(char const * name, std::vector<std::string> const & filters){
+		if(filters.empty()) return true;
+		for(unsigned i(0); i != filters.size(); ++i){
+			if(std::strstr(name, filters[i].c_str())) return true;
+		}
+		return false;
+	}
+}
+
+int main(int argc, char * argv[]){
+	int samples(default_samples);
+	int width(Xpixels), height(Ypixels);
+	bool window(false);
+	std::vector<std::string> filters;
+	for(int i(1); i < argc; ++i){
+		if(std::strcmp(argv[i], "--samples") == 0 and i + 1 < argc){
+			samples = std::max(1, std::atoi(argv[++i]));
+		}
+		else if(std::strcmp(argv[i], "--size") == 0 and i + 2 < argc){
+			width = std::atoi(argv[++i]);
+			height = std::atoi(argv[++i]);
+		}
+		else if(std::strcmp(argv[i], "--window") == 0){
+			window = true;
+		}
+		else {
+			filters.push_back(argv[i]);
+		}
+	}
+	SetHeadless(not window);
+	try {
+		playpen p(width, height);
+		std::printf("{\n  \"headless\": %s,\n  \"width\": %d,\n  \"height\": %d,\n"
+					"  \"samples\": %d,\n  \"benchmarks\": [",
+					IsHeadless() ? "true" : "false", p.width(), p.height(), samples);
+		char const * separator("\n");
+		for(unsigned i(0); i != sizeof benchmarks / sizeof benchmarks[0]; ++i){
+			if(not selected(benchmarks[i].name, filters)) continue;
+			result const r(measure(benchmarks[i], p, samples));
+			std::printf("%s    {\"name\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.1f, "
+						"\"mb_per_s\": %.1f, \"p50_ns\": %.1f, \"p90_ns\": %.1f, "
+						"\"p99_ns\": %.1f}",
+						separator, benchmarks[i].name, r.ops, r.ns_per_op,
+						r.mb_per_s, r.p50, r.p90, r.p99);
+			std::fflush(stdout);
+			separator = ",\n";
+		}
+		std::printf("\n  ]\n}\n");
+		std::remove(png_file);
+	}
+	catch(playpen::exception const & e){
+		std::remove(png_file);
+		e.report();
+		return 1;
+	}
+	catch(MiniPNG::error const & e){
+		std::remove(png_file);
+		std::cerr << "PNG error: " << e.message() << '\n';
+		return 1;
+	}
+	return 0;
+}
@@ -1,150 +1,49 @@
-#include "playpen.h"
-#include <stack>
+#include "flood_fill.h"
+#include <iostream>
 
 using namespace std;
 
 namespace fgw {
 	namespace {
-		struct point_ij{
-			int i;
-			int j;
-		};
-	}
-	void seed_fill(fgw::playpen & canvas, int i, int j, fgw::hue new_shade, fgw::hue boundary){
-	// convert to internal representation	
-		playpen::raw_pixel_data const raw_seed(canvas.get_raw_xy(i,j));
-		if(raw_seed.x() > Xpixels or raw_seed.x() < 0 or raw_seed.y() > Ypixels or raw_seed.y() < 0){
-			cerr << "Seed for fill outside Playpen. Nothing to do.\n"
-				 << "Did you forget the scale is " << canvas.scale() << "?\n";
-			return;
-		}
-		point_ij seed;
-		seed.i = raw_seed.x();
-		seed.j = raw_seed.y();
-		std::stack<point_ij> pixel_stack;  
-		pixel_stack.push(seed);
-		while(not pixel_stack.empty()){
-			point_ij pixel(pixel_stack.top());
-			canvas.setrawpixel(pixel.i, pixel.j, new_shade);
-	// go left
-			--pixel.i;
-			while(pixel.i >= 0  and canvas.getrawpixel(pixel.i, pixel.j) != boundary){
-					canvas.setrawpixel(pixel.i, pixel.j, new_shade);
-					--pixel.i;
-			}
-			int extreme_left(pixel.i + 1);
-			pixel.i = pixel_stack.top().i + 1;
-			pixel_stack.pop();
-	// go right	
-			while(pixel.i < Xpixels and canvas.getrawpixel(pixel.i, pixel.j) != boundary){
-					canvas.setrawpixel(pixel.i, pixel.j, new_shade);
-					++pixel.i;
-			}
-			int extreme_right(pixel.i - 1);
-	// scan row above
-			point_ij save(pixel);
-			--pixel.j;
-		    if (pixel.j > 0){
-		      bool previous_pixel_is_border(true);
-		      for(pixel.i = extreme_right; pixel.i >= extreme_left; --pixel.i){
-		        if(previous_pixel_is_border and canvas.getrawpixel(pixel.i, pixel.j) != boundary 
-					and canvas.getrawpixel(pixel.i, pixel.j) != new_shade){
-		          pixel_stack.push(pixel);
-		          previous_pixel_is_border = false;
-		        }
-		        else {
-			        if(canvas.getrawpixel(pixel.i, pixel.j) == boundary or canvas.getrawpixel(pixel.i, pixel.j) == new_shade)
-			          previous_pixel_is_border = true;
-				}
-		      }
-		    }
-	// scan below 
-			pixel = save;        
-		    ++pixel.j;
-			if (pixel.j < Ypixels -1){
-		      bool previous_pixel_is_border = true;
-			  for(pixel.i = extreme_right; pixel.i >= extreme_left; --pixel.i){
-		        if (previous_pixel_is_border and canvas.getrawpixel(pixel.i, pixel.j) != boundary 
-											and canvas.getrawpixel(pixel.i, pixel.j) != new_shade){
-		          pixel_stack.push(pixel);
-		          previous_pixel_is_border = false;
-		        }
-		        else {
-			        if (canvas.getrawpixel(pixel.i, pixel.j) == boundary or canvas.getrawpixel(pixel.i, pixel.j) == new_shade)
-			          previous_pixel_is_border = true;
-				}
-			  }
+	// convert to internal representation, complaining if the seed is off
+	// the playpen
+		bool raw_seed(fgw::playpen & canvas, int i, int j, int & x, int & y){
+			playpen::raw_pixel_data const raw(canvas.get_raw_xy(i,j));
+			if(raw.x() >= canvas.width() or raw.x() < 0 or raw.y() >= canvas.height() or raw.y() < 0){
+				cerr << "Seed for fill outside Playpen. Nothing to do.\n"
+					 << "Did you forget the scale is " << canvas.scale() << "?\n";
+				return false;
 			}
+			x = raw.x();
+			y = raw.y();
+			return true;
 		}
-	}            
+	}
+
+	// The fills work a whole run of pixels at a time straight on the
+	// playpen's rows; see playpen::fillrawregion.
+	void seed_fill(fgw::playpen & canvas, int i, int j, fgw::hue new_shade, fgw::hue boundary){
+		int x, y;
+		if(raw_seed(canvas, i, j, x, y)) canvas.fillrawregion(x, y, new_shade, boundary);
+	}
+
 	// this one replces colour of seed with a new colour and then
 	// fill applies that to adjecent pixels as long as they are the same colour
 	// as the seed pixel was.
-	
 	void replace_hue(fgw::playpen & canvas, int i, int j, fgw::hue new_shade){
-		playpen::raw_pixel_data const raw_seed(canvas.get_raw_xy(i,j));
-		point_ij seed;
-		if(raw_seed.x() > Xpixels or raw_seed.x() < 0 or raw_seed.y() > Ypixels or raw_seed.y() < 0){
-			cerr << "Seed for fill outside Playpen. Nothing to do.\n"
-				 << "Did you forget the scale is " << canvas.scale() << "?\n";
-			return;
-		}
-		seed.i = raw_seed.x();
-		seed.j = raw_seed.y();
-		hue old_shade(canvas.getrawpixel(seed.i, seed.j));
-		std::stack<point_ij> pixel_stack;  
-		pixel_stack.push(seed);
-		while(not pixel_stack.empty()){
-			point_ij pixel(pixel_stack.top());
-			canvas.setrawpixel(pixel.i, pixel.j, new_shade);
-	// go left
-			--pixel.i;
-			while(pixel.i >= 0  and canvas.getrawpixel(pixel.i, pixel.j) == old_shade){
-					canvas.setrawpixel(pixel.i, pixel.j, new_shade);
-					--pixel.i;
-			}
-			int extreme_left(pixel.i + 1);
-			pixel.i = pixel_stack.top().i + 1;
-			pixel_stack.pop();
-	// go right	
-			while(pixel.i < Xpixels and canvas.getrawpixel(pixel.i, pixel.j) == old_shade){
-					canvas.setrawpixel(pixel.i, pixel.j, new_shade);
-					++pixel.i;
-			}
-			int extreme_right(pixel.i - 1);
-	// scan row above
-			point_ij save(pixel);
-			--pixel.j;
-		    if (pixel.j > 0){
-		      bool previous_pixel_is_border(true);
-		      for(pixel.i = extreme_right; pixel.i >= extreme_left; --pixel.i){
-		        if(previous_pixel_is_border and canvas.getrawpixel(pixel.i, pixel.j)== old_shade){
-		          pixel_stack.push(pixel);
-		          previous_pixel_is_border = false;
-		        }
-		        else {
-			        if(canvas.getrawpixel(pixel.i, pixel.j) != old_shade)
-			          previous_pixel_is_border = true;
-				}
-		      }
-		    }
-	// scan below 
-			pixel = save;        
-		    ++pixel.j;
-			if (pixel.j < Ypixels -1){
-		      bool previous_pixel_is_border = true;
-			  for(pixel.i = extreme_right; pixel.i >= extreme_left; --pixel.i){
-		        if (previous_pixel_is_border and canvas.getrawpixel(pixel.i, pixel.j) == old_shade){
-		          pixel_stack.push(pixel);
-		          previous_pixel_is_border = false;
-		        }
-		        else {
-			        if (canvas.getrawpixel(pixel.i, pixel.j) != old_shade)
-			          previous_pixel_is_border = true;
-				}
-			  }
-			}
-		}
-	}            
-}
+		int x, y;
+		if(raw_seed(canvas, i, j, x, y)) canvas.replacerawregion(x, y, new_shade);
+	}
+
+	unsigned label_regions(fgw::playpen const & canvas, std::vector<unsigned> & labels,
+		std::vector<fgw::playpen::region> & regions, connectivity c){
+		return canvas.labelrawregions(labels, regions, c == eight_connected);
+	}
 
+	int region_at(fgw::playpen const & canvas, std::vector<unsigned> const & labels, int i, int j){
+		int const x(canvas.origin().x() + i * canvas.scale());
+		int const y(canvas.origin().y() - j * canvas.scale());
+		if(x < 0 or x >= canvas.width() or y < 0 or y >= canvas.height()) return -1;
+		return labels[std::size_t(y) * canvas.width() + x];
+	}
+}
@@ -2,11 +2,30 @@
 #define FLOOD_FILLS_H
 
 #include "playpen.h"
+#include <vector>
 
 namespace fgw{
+// Both fill the region 4-connected to the seed (i, j): seed_fill spreads
+// through pixels that are neither boundary nor new_hue, replace_hue through
+// pixels of the seed's hue.
 	void seed_fill(fgw::playpen & canvas, int i, int j, fgw::hue new_hue, fgw::hue boundary);
 	void replace_hue(fgw::playpen & canvas, int i, int j, fgw::hue new_hue);
 
+// Which pixels touch for label_regions: those sharing an edge, or those
+// sharing an edge or a corner.
+	enum connectivity {four_connected, eight_connected};
+
+// Find every region of connected pixels of one hue in a single sweep of
+// the canvas instead of a replace_hue per region. labels gets a label per
+// raw pixel, the index in regions of the region holding it, whose size
+// and bounding box (in raw pixels) are given there. Returns the number
+// of regions.
+	unsigned label_regions(fgw::playpen const & canvas, std::vector<unsigned> & labels,
+		std::vector<fgw::playpen::region> & regions, connectivity c = four_connected);
+// For hit testing: the label of the (logical) pixel (i, j) as the canvas's
+// origin and scale now place it, or -1 if that is off the canvas.
+	int region_at(fgw::playpen const & canvas, std::vector<unsigned> const & labels, int i, int j);
+
 
 }
 
@@ -0,0 +1,39 @@
+#include "frame_clock.h"
+
+namespace studentgraphics {
+	frame_clock::frame_clock(double frames_per_second)
+		: period(1.0 / (frames_per_second > 0 ? frames_per_second : 60)),
+		deadline(0), frame_count(0), missed_count(0), pending(0){
+		restart();
+	}
+
+	int frame_clock::next_frame(){
+		if(pending){
+			pending->display();
+			pending = 0;
+		}
+		++frame_count;
+		deadline += period;
+		double const now(MonotonicTime());
+		int missed(0);
+		if(now > deadline){
+			// skip the deadlines that have already gone
+			missed = int((now - deadline) / period) + 1;
+			deadline += missed * period;
+			missed_count += missed;
+		}
+		WaitUntil(deadline);
+		return missed;
+	}
+
+	frame_clock & frame_clock::display(playpen const & p){
+		pending = &p;
+		return *this;
+	}
+
+	frame_clock & frame_clock::restart(){
+		deadline = MonotonicTime();
+		missed_count = 0;
+		return *this;
+	}
+}
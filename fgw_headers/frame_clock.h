@@ -0,0 +1,50 @@
+// frame_clock.h - Pacing for animation loops.
+//
+// Replaces the usual "draw; display(); Wait(16);" with
+//
+//		frame_clock fc(60);
+//		for(;;){ draw; fc.display(pp); fc.next_frame(); }
+//
+// next_frame() sleeps until a fixed deadline rather than for a fixed
+// time, so the time spent drawing does not add up into drift.
+
+#if !defined(FRAME_CLOCK_H)
+#define FRAME_CLOCK_H
+
+#include "playpen.h"
+
+namespace studentgraphics {
+
+	class frame_clock {
+	public:
+		// The first frame starts now.
+		explicit frame_clock(double frames_per_second = 60);
+
+		// Show the frame if display() was asked for, then sleep until the
+		// next frame is due. Returns the number of deadlines missed since
+		// the previous call, 0 when the frame was on time. A late frame
+		// does not cause a burst of catching up: the next deadline is the
+		// next one still in the future.
+		int next_frame();
+
+		// Coalesces displays: p.display() is called once, by next_frame(),
+		// however many times this is called during a frame.
+		frame_clock & display(playpen const & p);
+
+		// Start again from now, forgetting missed deadlines.
+		frame_clock & restart();
+
+		long frames()const {return frame_count;}
+		long missed()const {return missed_count;}
+		double interval()const {return period;}
+
+	private:
+		double period;			// seconds
+		double deadline;		// of the current frame, by MonotonicTime()
+		long frame_count;
+		long missed_count;
+		playpen const * pending;
+	};
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define LINE_DRAWING_H
 #include "playpen.h"
 #include "point2d.h"
+#include "plot_kernels.h"
 #include <fstream>
 #include <cmath>
 
@@ -72,6 +73,75 @@ inline void horizontal_line(fgw::playpen & p, int yval, int x1, int x2, plot_pol
 		return horizontal_line(p,int(pt.y()+.5),int(pt.x()+.5), int(pt.x()+length+.5), black, plotter);
 	}
 
+// Many lines in one call. Each point is rounded once and every line goes
+// through playpen::plot_line, so the parts off the canvas cost nothing.
+// No pixel is plotted twice at a shared vertex, which matters in the
+// additive, filter and disjoint plot modes.
+// drawpolyline joins the n points in order and plots the last one as well,
+// unless it is the same pixel as the first (a closed shape).
+	void drawpolyline(fgw::playpen & p, fgw::point2d const * pts, int n, fgw::hue shade = fgw::black);
+// draw_segments draws n/2 separate lines, from pts[0] to pts[1], pts[2]
+// to pts[3] and so on, end points included. An end point that is the start
+// of the next line is left to that line.
+	void draw_segments(fgw::playpen & p, fgw::point2d const * pts, int n, fgw::hue shade = fgw::black);
+
+// Policy based versions where the policy is a template parameter. Any
+// function object (or function pointer) callable as
+// plotter(playpen &, int x, int y, hue) will do; a function object lets the
+// compiler inline the per pixel call into the stepping loop. The function
+// pointer versions above are still picked when a plot_policy is passed.
+	struct plot_pixel {
+		void operator()(fgw::playpen & canvas, int x, int y, fgw::hue shade)const {
+			canvas.plot(x, y, shade);
+		}
+	};
+
+	template<class Plotter>
+	void vertical_line(fgw::playpen & p, int xval, int y1, int y2, fgw::hue shade, Plotter plotter){
+		if (y1 < y2)
+			for(int i(y1); i != y2 ; ++i) plotter(p, xval, i, shade);
+		else
+			for(int i(y1); i != y2; --i) plotter(p, xval, i, shade);
+	}
+
+	template<class Plotter>
+	void horizontal_line(fgw::playpen & p, int yval, int x1, int x2, fgw::hue shade, Plotter plotter){
+		if (x2 < x1)
+			for(int i(x1); i != x2; --i) plotter(p, i, yval, shade);
+		else
+			for(int i(x1); i != x2; ++i) plotter(p, i, yval, shade);
+	}
+
+// drawline with a policy based plot method. Bresenham's algorithm; the end
+// point is not plotted so that joined lines do not plot their joints twice.
+	template<class Plotter>
+	void drawline(fgw::playpen & p, int begin_x, int begin_y, int end_x, int end_y, fgw::hue shade, Plotter plotter){
+		for(studentgraphics::detail::LineSteps line(begin_x, begin_y, end_x, end_y); line.count != 0; line.Step()){
+			plotter(p, line.x, line.y, shade);
+		}
+	}
+
+// plot_pixel does nothing but plot, so these go to playpen::plot_line,
+// which clips the line and writes straight to the pixels.
+	inline void drawline(fgw::playpen & p, int begin_x, int begin_y, int end_x, int end_y, fgw::hue shade, plot_pixel){
+		p.plot_line(begin_x, begin_y, end_x, end_y, shade);
+	}
+	inline void vertical_line(fgw::playpen & p, int xval, int y1, int y2, fgw::hue shade, plot_pixel){
+		p.plot_line(xval, y1, xval, y2, shade);
+	}
+	inline void horizontal_line(fgw::playpen & p, int yval, int x1, int x2, fgw::hue shade, plot_pixel){
+		p.plot_line(x1, yval, x2, yval, shade);
+	}
+
+	template<class Plotter>
+	inline void drawline(fgw::playpen & p, fgw::point2d begin, fgw::point2d end, fgw::hue shade, Plotter plotter){
+		drawline(p,
+		int(std::floor(begin.x()+.5)),
+		int(std::floor(begin.y()+.5)),
+		int(std::floor(end.x()+0.5)),
+		int(std::floor(end.y()+0.5)), shade, plotter);
+	}
+
 // old versions implementation provided by defaults to above
 //	  inline void drawline(playpen & p, int beginx, int beginy, int endx, int endy, hue c=black){
 //	  	  drawline(p, beginx, beginy, endx, endy, c, plot);
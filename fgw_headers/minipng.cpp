@@ -3,8 +3,7 @@
 // Future Enhancements:
 // 1. Support image formats other than 8bpp paletted.
 // 2. Support interlacing.
-// 3. More sophisticated use of filters during save.
-// 4. Support standard non-critical chunks.
+// 3. Support standard non-critical chunks.
 
 #include <climits>	// For UINT_MAX.
 #include <stdlib.h>	// Use .h form because MSVC6 has issues with cstdlib.
@@ -13,12 +12,19 @@
 #include <iostream>
 #include <vector>
 #include <fstream>
+#include <string.h>	// For memcpy.
+#include <exception>
 
 #include "minipng.h"
 extern "C"{
 	#include "zlib.h"		// For (de-)compression.
 }
 #include "playpen.h"	// For playpen integration.
+#include "plot_kernels.h"	// For RunConcurrently and RunInBackground.
+#include "stats_counters.h"
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
    namespace {
       using namespace MiniPNG;
@@ -42,6 +48,16 @@ extern "C"{
       const MiniPNG_UInt32 IHDRChunkLength = 13;
       const MiniPNG_UInt32 IENDChunkLength = 0;
    
+   // PNGWriter gathers compressed data until it has at least this much
+   // before writing an IDAT chunk, so that large images are not spread
+   // over thousands of small chunks, each with its own header and CRC.
+      const unsigned IDATChunkSize = 65536;
+   
+   // A parallel encode gives each thread a stripe of at least this many
+   // bytes of scanlines: smaller stripes would lose more in starting 
+   // threads, and in compression across their edges, than they gain.
+      const unsigned long MinStripeBytes = 1 << 18;
+   
    // IHDR chunk constants.
       const unsigned char		BitDepth		= 8;	// 8 bits per pixel.
       const unsigned char		ColorType		= 3;	// Colour palette.
@@ -118,8 +134,13 @@ extern "C"{
       private:
          enum {TableEntryCount = 256};
       
-         static bool				tableInitDone_;
-         static MiniPNG_UInt32	table_[TableEntryCount];
+      // The lookup table. It is filled in during static initialisation,
+      // before any thread saving in the background can start.
+         struct Table {
+            Table();
+            MiniPNG_UInt32	entries[TableEntryCount];
+         };
+         static Table const		table_;
       
          MiniPNG_UInt32	runningCRC_;
       };// class CRCCalculator
@@ -129,12 +150,13 @@ extern "C"{
       public:
          BufferedZLibStream();
       
-         void CompressInit();
+         void CompressInit(int level, int strategy, bool raw);
          void DecompressInit();
          void CompressUninit();
          void DecompressUninit();
       
          void Compress(const unsigned char* src, unsigned len);
+         void CompressFlush();
          void CompressFinish();
          void Decompress(const unsigned char* src, unsigned len);
       
@@ -160,18 +182,21 @@ extern "C"{
          BufferedZLibStream& operator=(const BufferedZLibStream&);
       };// class BufferedZLibStream
    
-   // Uses deflate-type GLib compression.
+   // Uses deflate-type GLib compression, at the given zlib level and
+   // strategy. A raw Compressor leaves out the zlib header and trailer.
    // Normal non-error usage is:
    // 1. Construct.
    // 2. Zero or more calls to Compress.
-   // 3. Exactly one call to Finish.
+   // 3. Exactly one call to Finish, or for a raw Compressor whose output
+   //	will have more deflate data put after it, to Flush.
    // 4. Destroy.
    // Calls to GetDstLength, GetDstPtr and ClearDst may be made at any point
    // on a fully constructed Compressor, but if you want to get all the output
    // you need to do so after the call to Finish.
        class Compressor {
       public:
-          Compressor()	{stm_.CompressInit();}
+          Compressor(int level, int strategy, bool raw = false)
+         {stm_.CompressInit(level, strategy, raw);}
           ~Compressor()	{stm_.CompressUninit();}
       
           void Compress(const unsigned char* srcBuffer, unsigned len)
@@ -182,6 +207,10 @@ extern "C"{
       
           void Finish() {stm_.CompressFinish();}
       
+      // End the output with an empty stored block, so that it finishes on
+      // a byte boundary with no block left open.
+          void Flush() {stm_.CompressFlush();}
+      
           unsigned GetDstLength() const {
             return stm_.GetDstLength();}
           const unsigned char* GetDstPtr() const 	{
@@ -210,84 +239,107 @@ extern "C"{
          BufferedZLibStream stm_;
       };// class Decompressor
    
-   // Abstract class for filters. Before compression, each scanline is
-   // filtered using one of the standard PNG filters and a byte is added
-   // to the data to indicate which filter was used. The idea is that 
-   // filtering can improve the compression ratio.
-       class Filter {
-      public:
-		virtual ~Filter(){}
-      // Purpose:
-      //	Notify that a scanline is about to be unfiltered using this filter
-      //	algoritm.
-      // Parameters:
-      //	[in] prior -	Pointer to the first raw (uncompressed, unfiltered)
-      //					pixel on the previous scanline,	or 0, if this is 
-      //					the topmost scanline.
-         virtual void BeginScanline(const unsigned char* prior) = 0;
-      
-      // Purpose:
-      //	Unfilter a byte previously filtered using this algorithm.
-      // Returns:
-      //	The unfiltered byte value.
-      // Parameters:
-      //	[in] filtered -	The filtered byte value to be unfiltered.
-         virtual unsigned char Unfilter(unsigned char filtered) = 0;
-      };// class Filter
-   
-   // Referred to as Filter Type 0: None in PNG spec.
-       class PassThruFilter : public Filter {
-      public:
-          virtual void BeginScanline(const unsigned char*) {}
-          virtual unsigned char Unfilter(unsigned char filtered) 
-         { 
-            return filtered; }
+   // Before compression each scanline is filtered using one of the
+   // standard PNG filters and a byte is added to the data to indicate
+   // which filter was used. The idea is that filtering can improve the
+   // compression ratio. Filter identification codes:
+      enum {
+      PassThruFilterCode,	// Filter Type 0: None in PNG spec.
+      SubFilterCode,		// 1: Sub
+      UpFilterCode,		// 2: Up
+      AverageFilterCode,	// 3: Average
+      PaethFilterCode		// 4: Paeth
       };
    
-   // Filter Type 1: Sub
-       class SubFilter : public Filter {
-      public:
-         virtual void BeginScanline(const unsigned char* prior);
-         virtual unsigned char Unfilter(unsigned char filtered);
-      
-      private:
-         unsigned char leftRaw_;
+   // Purpose:
+   //	Unfilter a whole scanline in place.
+   // Parameters:
+   //	[in] filterCode -	The filter byte that came before the scanline.
+   //	[in, out] row -		The width filtered bytes of the scanline, which
+   //						become the raw (unfiltered) pixels.
+   //	[in] prior -		The raw pixels of the previous scanline, or 
+   //						width zeros for the topmost scanline.
+   // Exceptions:
+   //	Throws error for an unknown filter code.
+      void UnfilterScanline(unsigned char filterCode, 
+      unsigned char* row, const unsigned char* prior, unsigned width);
+   
+   // Purpose:
+   //	Filter a whole scanline for saving.
+   // Parameters:
+   //	[in] filterCode -	The filter to use.
+   //	[out] dst -			Receives the width filtered bytes.
+   //	[in] row -			The raw pixels of the scanline.
+   //	[in] prior -		The raw pixels of the previous scanline, or 
+   //						width zeros for the topmost scanline.
+   // Returns:
+   //	The sum of the filtered bytes' magnitudes, each taken as a signed 
+   //	value from -128 to 127. The PNG spec suggests choosing the filter
+   //	that makes this smallest.
+      unsigned FilterScanline(unsigned char filterCode, unsigned char* dst,
+      const unsigned char* row, const unsigned char* prior, unsigned width);
+   
+   // What a Compression setting means: whether scanlines are filtered, 
+   // and the zlib level and strategy.
+       struct CompressionSettings {
+         explicit CompressionSettings(Compression compression);
+      
+         bool	filter;
+         int		level;
+         int		strategy;
       };
    
-   // Filter Type 2: Up
-       class UpFilter : public Filter {
+   // Filters scanlines of a given width every way, to choose the best.
+       class ScanlineFilter {
       public:
-         virtual void BeginScanline(const unsigned char* prior);
-         virtual unsigned char Unfilter(unsigned char filtered);
+          explicit ScanlineFilter(unsigned width) : 
+          width_(width), filtered_(5 * width) {}
       
-      private:
-         const unsigned char*	aboveRaw_;	// NULL pointer if first scanline.
-      };
-   
-   // Filter Type 3: Average
-       class AverageFilter : public Filter {
-      public:
-         virtual void BeginScanline(const unsigned char* prior);
-         virtual unsigned char Unfilter(unsigned char filtered);
+      // Returns the code of the filter whose bytes have the smallest sum
+      // of magnitudes, as FilterScanline measures it.
+         unsigned char Choose(
+         const unsigned char* row, const unsigned char* prior);
       
-      private:
-         const unsigned char*	aboveRaw_;	// NULL pointer if first scanline.
-         unsigned char			leftRaw_;
-      };// class AverageFilter
-   
-   // Filter Type 4: Paeth
-       class PaethFilter : public Filter {
-      public:
-         virtual void BeginScanline(const unsigned char* prior);
-         virtual unsigned char Unfilter(unsigned char filtered);
+      // The bytes filterCode gave in the last call of Choose.
+          const unsigned char* GetFiltered(unsigned char filterCode) const {
+            return &filtered_[filterCode * width_];}
       
       private:
-         const unsigned char*	aboveRaw_;	// NULL pointer if first scanline.
-         const unsigned char*	aboveLeftRaw_;	// NULL if first scanline or x == 0
-         unsigned char			leftRaw_;	
-      
-         static int PaethPredictor(int left, int above, int aboveLeft);	
-      };// class PaethFilter
+         unsigned					width_;
+         std::vector<unsigned char>	filtered_;
+      };// class ScanlineFilter
+   
+   // A horizontal stripe of a parallel encode. Each is compressed on a 
+   // thread of its own into raw deflate data, with no zlib header or 
+   // trailer. Every stripe but the last ends with a flush to a byte 
+   // boundary, so the stripes' data put one after another makes a single
+   // deflate stream.
+       struct IDATStripe {
+         const unsigned char*		pixels;		// The stripe's first row.
+         const unsigned char*		prior;		// The row above it, or zeros.
+         unsigned					width;
+         unsigned					rows;
+         Compression					compression;
+         bool						last;		// The bottom stripe.
+         std::vector<unsigned char>	data;		// Compressed output.
+         MiniPNG_UInt32				adler;		// Adler-32 of the input.
+         std::string					failure;	// Empty unless it failed.
+      };
+   
+   // RunConcurrently job compressing an IDATStripe. Exceptions are caught
+   // and recorded in the stripe, to be thrown again on the calling thread.
+      void CompressStripe(void* stripe);
+   
+   // Purpose:
+   //	Combine the Adler-32 checksums of two pieces of data.
+   // Parameters:
+   //	[in] first -		The checksum of the first piece.
+   //	[in] second -		The checksum of the second piece.
+   //	[in] secondLength -	The length of the second piece in bytes.
+   // Returns:
+   //	The checksum of the first piece followed by the second.
+      MiniPNG_UInt32 CombineAdler32(MiniPNG_UInt32 first, 
+      MiniPNG_UInt32 second, unsigned long secondLength);
    
        class PNGChunkWriter {
       public:
@@ -350,9 +402,15 @@ extern "C"{
    // Top-level class for writing a PNG image to a stream.
        class PNGWriter {
       public:
+          PNGWriter(Compression compression, int threads) : 
+          compression_(compression), threads_(threads) {}
          void operator()(std::ostream& stm, ReadableImage& image);
       
       private:
+         typedef std::vector<unsigned char>	Buffer;
+      
+         Compression				compression_;
+         int						threads_;
          std::ostream*			stm_;
          ReadableImage*			image_;
          MiniPNG_UInt32			width_;
@@ -362,6 +420,7 @@ extern "C"{
          void WriteIHDRChunk();
          void WritePLTEChunk();
          void WriteIDATChunks();
+         void WriteIDATChunksInStripes(unsigned stripes);
          void WriteIENDChunk();
       };// class PNGWriter
    
@@ -396,41 +455,22 @@ extern "C"{
          AllRequiredChunks = 0xF
          };
       
-      // Filter identification codes.
-         enum {
-         PassThruFilterCode,
-         SubFilterCode,
-         UpFilterCode,
-         AverageFilterCode,
-         PaethFilterCode
-         };
-      
          typedef std::vector<unsigned char>	Buffer;
-         typedef Buffer::iterator			BufferIterator;
       
          std::istream*	stm_;
          WritableImage*	image_;
          unsigned		chunksRead_;	// Bitfield of required chunks.
          MiniPNG_UInt32	width_;
          MiniPNG_UInt32	height_;
-         Buffer			rawPriorScanline_;	// Buffer for previous raw scanline.	
-         Buffer			rawScanline_;	// Buffer for current raw scanline.
-         BufferIterator	curRaw_;		// Iterator to current raw pixel.
-         BufferIterator	endRaw_;		// Current scanline end iterator.
+      // Each scanline buffer holds the filter byte and then the pixels.
+         Buffer			rawPriorScanline_;	// Previous scanline, unfiltered.
+         Buffer			rawScanline_;	// Current scanline as it arrives.
+         unsigned		scanlineFill_;	// Bytes of it received so far.
          int				curY_;			// Current y co-ordinate.
          bool			imageDone_;		// All image data is read.
          Decompressor	decompressor_;
          Buffer			compBuffer_;		// Buffer for compressed data.
       
-      // The available filters for doing Unfilter operations.
-         PassThruFilter	passThruFilter_;	
-         SubFilter		subFilter_;
-         UpFilter		upFilter_;
-         AverageFilter	averageFilter_;
-         PaethFilter		paethFilter_;
-      
-         Filter*			curFilter_;	// The currently in use filter.
-      
          void ReadChunk();
          void CheckSignature();
          void ProcessChunksRead(unsigned curChunk);
@@ -482,25 +522,28 @@ extern "C"{
    
        void WriteUInt32(std::ostream& stm, MiniPNG_UInt32 ui) {
       // PNG uses network byte order i.e. most significant byte first.
-         WriteByte(stm, (ui & 0xFF000000) >> 24);
-         WriteByte(stm, (ui & 0x00FF0000) >> 16);
-         WriteByte(stm, (ui & 0x0000FF00) >> 8);
-         WriteByte(stm, ui & 0x000000FF);
+         unsigned char bytes[4];
+         bytes[0] = (unsigned char)((ui & 0xFF000000) >> 24);
+         bytes[1] = (unsigned char)((ui & 0x00FF0000) >> 16);
+         bytes[2] = (unsigned char)((ui & 0x0000FF00) >> 8);
+         bytes[3] = (unsigned char)(ui & 0x000000FF);
+         WriteBuffer(stm, bytes, 4);
       }
    
        void WriteBuffer(std::ostream& stm, 
        const unsigned char* buf, unsigned len) {
       
-         for (unsigned i = 0; i < len; ++i) {
-            WriteByte(stm, *buf++);
+         if (!stm.write(static_cast<const char*>(
+            static_cast<const void*>(buf)), len)) {
+            throw error("Bad stream in WriteBuffer.");
          }
       }
    
        void ReadBuffer(std::istream& stm, 
        unsigned char* buf, unsigned len) {
       
-         for (unsigned i = 0; i < len; ++i) {
-            *buf++ = ReadByte(stm);
+         if (!stm.read(static_cast<char*>(static_cast<void*>(buf)), len)) {
+            throw error("Bad stream in ReadBuffer.");
          }
       }
    
@@ -513,123 +556,361 @@ extern "C"{
          value_ |= static_cast<MiniPNG_UInt32>(type[3]);		
       }
    
-   // SubFilter ------------------------------------------------------------
+   // Scanline unfiltering ------------------------------------------------
    
-   /*virtual*/ 
-       void SubFilter::BeginScanline(const unsigned char*) {
-         leftRaw_ = 0;
+   // With one byte per pixel Sub, Average and Paeth each depend on the
+   // pixel just unfiltered to the left, so only Up is independent byte by
+   // byte. Sub is a running sum, which SSE2 can still do 16 bytes at a
+   // time; Average and Paeth are left as tight loops, Paeth choosing its
+   // predictor without branches.
+   #if defined(__GNUC__) && defined(__SSE2__)
+   #define MINIPNG_SSE2
+   #endif
+   
+   // PNG Spec says:
+   //	Sub(x) = Raw(x) - Raw(x-bpp)
+   // So,
+   //	Raw(x) = Sub(x) + Raw(x-bpp)
+       void UnfilterSub(unsigned char* row, unsigned width) {
+         unsigned x = 1;
+      #if defined(MINIPNG_SSE2)
+         __m128i left = _mm_setzero_si128();
+         for (x = 0; x + 16 <= width; x += 16) {
+            __m128i* p = reinterpret_cast<__m128i*>(row + x);
+            __m128i v = _mm_loadu_si128(p);
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 1));
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+            v = _mm_add_epi8(v, left);
+            _mm_storeu_si128(p, v);
+         // Spread the last byte across the register for the next block.
+            left = _mm_unpackhi_epi8(v, v);
+            left = _mm_unpackhi_epi16(left, left);
+            left = _mm_shuffle_epi32(left, 0xFF);
+         }
+         if (x == 0) {
+            x = 1;
+         }
+      #endif
+         for (; x < width; ++x) {
+            row[x] = (unsigned char)(row[x] + row[x - 1]);
+         }
       }
    
-   /*virtual*/ 
-       unsigned char SubFilter::Unfilter(unsigned char filtered) {
-      // The PNG spec says:
-      //	Sub(x) = Raw(x) - Raw(x-bpp)
-      // So,
-      //	Raw(x) = Sub(x) + Raw(x-bpp)
-         unsigned char raw = 
-            (static_cast<unsigned>(filtered) + leftRaw_) & 0xFF;
-         leftRaw_ = raw;
-         return raw;
+   // PNG Spec says:
+   //	Up(x) = Raw(x) - Prior(x)
+   // So,
+   //	Raw(x) = Up(x) + Prior(x)
+       void UnfilterUp(unsigned char* row, const unsigned char* prior, 
+       unsigned width) {
+         unsigned x = 0;
+      #if defined(MINIPNG_SSE2)
+         for (; x + 16 <= width; x += 16) {
+            __m128i* p = reinterpret_cast<__m128i*>(row + x);
+            _mm_storeu_si128(p, _mm_add_epi8(_mm_loadu_si128(p),
+               _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + x))));
+         }
+      #endif
+         for (; x < width; ++x) {
+            row[x] = (unsigned char)(row[x] + prior[x]);
+         }
       }
    
-   // UpFilter -------------------------------------------------------------
+   // PNG spec says:
+   //	Average(x) = Raw(x) - floor((Raw(x-bpp)+Prior(x))/2)
+   // So,
+   //	Raw(x) = Average(x) + floor((Raw(x-bpp)+Prior(x))/2)
+       void UnfilterAverage(unsigned char* row, const unsigned char* prior,
+       unsigned width) {
+         unsigned left = 0;
+         for (unsigned x = 0; x < width; ++x) {
+            left = (row[x] + ((left + prior[x]) >> 1)) & 0xFF;
+            row[x] = (unsigned char)left;
+         }
+      }
    
-   /*virtual*/ 
-       void UpFilter::BeginScanline(const unsigned char* prior) {
-         aboveRaw_ = prior;
+   // PNG spec says:
+   //	Paeth(x) = Raw(x) - 
+   //		PaethPredictor(Raw(x-bpp), Prior(x), Prior(x-bpp))
+   // So,
+   //	Raw(x) = Paeth(x) + PaethPredictor(...)
+   // The predictor, translated from pseudocode in the PNG spec, returns
+   // the nearest of left, above and aboveLeft to left + above - aboveLeft,
+   // breaking ties in that order. The distances come to |above -
+   // aboveLeft|, |left - aboveLeft| and |left + above - 2 * aboveLeft|.
+       inline int PaethPredictor(int left, int above, int aboveLeft) {
+         int const leftDistance = abs(above - aboveLeft);
+         int const aboveDistance = abs(left - aboveLeft);
+         int const aboveLeftDistance = abs(left + above - 2 * aboveLeft);
+         int const nearer = aboveDistance <= aboveLeftDistance 
+            ? above : aboveLeft;
+         int const nearerDistance = aboveDistance <= aboveLeftDistance
+            ? aboveDistance : aboveLeftDistance;
+         return leftDistance <= nearerDistance ? left : nearer;
       }
    
-   /*virtual*/ 
-       unsigned char UpFilter::Unfilter(unsigned char filtered) {
-      // PNG Spec says:
-      //	Up(x) = Raw(x) - Prior(x)
-      // So,
-      //	Raw(x) = Up(x) + Prior(x)
-         unsigned char raw = filtered;
-         if (aboveRaw_) {
-            raw = (static_cast<unsigned>(raw) + *aboveRaw_++) & 0xFF;
-         }
-         return raw;
+       void UnfilterPaeth(unsigned char* row, const unsigned char* prior,
+       unsigned width) {
+         int left = 0;
+         int aboveLeft = 0;
+         for (unsigned x = 0; x < width; ++x) {
+            int const above = prior[x];
+            left = (row[x] + PaethPredictor(left, above, aboveLeft)) & 0xFF;
+            row[x] = (unsigned char)left;
+            aboveLeft = above;
+         }
       }
    
-   // AverageFilter --------------------------------------------------------
+       void UnfilterScanline(unsigned char filterCode, 
+       unsigned char* row, const unsigned char* prior, unsigned width) {
+         switch (filterCode) {
+            case PassThruFilterCode:
+               break;
+            case SubFilterCode:
+               UnfilterSub(row, width);
+               break;
+            case UpFilterCode:
+               UnfilterUp(row, prior, width);
+               break;
+            case AverageFilterCode:
+               UnfilterAverage(row, prior, width);
+               break;
+            case PaethFilterCode:
+               UnfilterPaeth(row, prior, width);
+               break;
+            default:
+               throw error("UnfilterScanline found unknown filter type.");
+         }
+      }// UnfilterScanline
    
-   /*virtual*/ 
-       void AverageFilter::BeginScanline(const unsigned char* prior) {
-         aboveRaw_	= prior;
-         leftRaw_	= 0;
+   // Scanline filtering ---------------------------------------------------
+   
+   // Filtering for saving has none of the chain of dependence that 
+   // unfiltering has: every prediction comes from raw pixels already 
+   // known. So with SSE2 all four filters work 16 bytes at a time, 
+   // summing the magnitudes of the results as they go.
+   
+   // The prediction filterCode makes for a pixel from its left, above and
+   // above left neighbours (zero beyond the edges of the image).
+       inline int Predict(unsigned char filterCode, 
+       int left, int above, int aboveLeft) {
+         switch (filterCode) {
+            case SubFilterCode:
+               return left;
+            case UpFilterCode:
+               return above;
+            case AverageFilterCode:
+               return (left + above) >> 1;
+            case PaethFilterCode:
+               return PaethPredictor(left, above, aboveLeft);
+            default:
+               return 0;
+         }
       }
    
-   /*virtual*/ 
-       unsigned char AverageFilter::Unfilter(
-       unsigned char filtered) {
-      // PNG spec says:
-      //	Average(x) = Raw(x) - floor((Raw(x-bpp)+Prior(x))/2)
-      // So,
-      //	Raw(x) = Average(x) + floor((Raw(x-bpp)+Prior(x))/2)
-         unsigned char prior	= 0;		
-         if (aboveRaw_) {
-            prior = *aboveRaw_++;
-         }
-         unsigned char raw = 0xFF & (filtered + 
-            ((static_cast<unsigned>(leftRaw_) + prior) >> 1));
-         leftRaw_ = raw;
-         return raw;
-      }// AverageFilter::Unfilter
-   
-   // PaethFilter ----------------------------------------------------------
+   // A filtered byte's magnitude as a signed value.
+       inline unsigned Magnitude(unsigned char filtered) {
+         return filtered < 128 ? filtered : 256 - filtered;
+      }
    
-   /*virtual*/ 
-       void PaethFilter::BeginScanline(const unsigned char* prior) {
-         leftRaw_		= 0;
-         aboveRaw_		= prior;
-         aboveLeftRaw_	= 0;
+   #if defined(MINIPNG_SSE2)
+   // As above for 16 pixels at once.
+       inline __m128i Predict(unsigned char filterCode, 
+       __m128i left, __m128i above, __m128i aboveLeft) {
+         __m128i const zero = _mm_setzero_si128();
+         switch (filterCode) {
+            case SubFilterCode:
+               return left;
+            case UpFilterCode:
+               return above;
+            case AverageFilterCode:
+            // _mm_avg_epu8 rounds halves up; take them back down.
+               return _mm_sub_epi8(_mm_avg_epu8(left, above), 
+                  _mm_and_si128(_mm_xor_si128(left, above), 
+                     _mm_set1_epi8(1)));
+            case PaethFilterCode:
+               {
+               // The distances need more than 8 bits, so work on each
+               // half of the pixels in 16 bit lanes.
+                  __m128i halves[2];
+                  for (int half = 0; half < 2; ++half) {
+                     __m128i a, b, c;
+                     if (half == 0) {
+                        a = _mm_unpacklo_epi8(left, zero);
+                        b = _mm_unpacklo_epi8(above, zero);
+                        c = _mm_unpacklo_epi8(aboveLeft, zero);
+                     }
+                     else {
+                        a = _mm_unpackhi_epi8(left, zero);
+                        b = _mm_unpackhi_epi8(above, zero);
+                        c = _mm_unpackhi_epi8(aboveLeft, zero);
+                     }
+                     __m128i const bc = _mm_sub_epi16(b, c);
+                     __m128i const ac = _mm_sub_epi16(a, c);
+                     __m128i const abc = _mm_add_epi16(ac, bc);
+                     __m128i const pa = _mm_max_epi16(bc, 
+                        _mm_sub_epi16(zero, bc));
+                     __m128i const pb = _mm_max_epi16(ac, 
+                        _mm_sub_epi16(zero, ac));
+                     __m128i const pc = _mm_max_epi16(abc, 
+                        _mm_sub_epi16(zero, abc));
+                     __m128i const notA = _mm_or_si128(
+                        _mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+                     __m128i const notB = _mm_cmpgt_epi16(pb, pc);
+                     __m128i const bOrC = _mm_or_si128(
+                        _mm_and_si128(notB, c), _mm_andnot_si128(notB, b));
+                     halves[half] = _mm_or_si128(
+                        _mm_and_si128(notA, bOrC), _mm_andnot_si128(notA, a));
+                  }
+                  return _mm_packus_epi16(halves[0], halves[1]);
+               }
+            default:
+               return zero;
+         }
+      }
+   #endif
+   
+       unsigned FilterScanline(unsigned char filterCode, unsigned char* dst,
+       const unsigned char* row, const unsigned char* prior, unsigned width) {
+         unsigned sum = 0;
+         unsigned x = 0;
+      #if defined(MINIPNG_SSE2)
+      // The first pixel has no neighbours to the left, so the vectors 
+      // start from the second.
+         if (width > 16) {
+            dst[0] = (unsigned char)(row[0] - 
+               Predict(filterCode, 0, prior[0], 0));
+            sum = Magnitude(dst[0]);
+            __m128i const zero = _mm_setzero_si128();
+            __m128i sums = zero;
+            for (x = 1; x + 16 <= width; x += 16) {
+               __m128i const raw = _mm_loadu_si128(
+                  reinterpret_cast<const __m128i*>(row + x));
+               __m128i const predicted = Predict(filterCode,
+                  _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x - 1)),
+                  _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + x)),
+                  _mm_loadu_si128(
+                     reinterpret_cast<const __m128i*>(prior + x - 1)));
+               __m128i const filtered = _mm_sub_epi8(raw, predicted);
+               _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), filtered);
+            // min(v, -v) is the magnitude of v as a signed byte.
+               sums = _mm_add_epi64(sums, _mm_sad_epu8(zero, _mm_min_epu8(
+                  filtered, _mm_sub_epi8(zero, filtered))));
+            }
+            sum += _mm_cvtsi128_si32(sums) + 
+               _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums));
+         }
+      #endif
+         for (; x < width; ++x) {
+            int const left = x ? row[x - 1] : 0;
+            int const aboveLeft = x ? prior[x - 1] : 0;
+            dst[x] = (unsigned char)(row[x] - 
+               Predict(filterCode, left, prior[x], aboveLeft));
+            sum += Magnitude(dst[x]);
+         }
+         return sum;
+      }// FilterScanline
+   
+   // FastCompression leaves every scanline unfiltered; the others try 
+   // each filter on each scanline, and suit zlib's strategy to the small
+   // values filtering tends to leave.
+       CompressionSettings::CompressionSettings(Compression compression) :
+       filter	(compression != FastCompression),
+       level	(Z_DEFAULT_COMPRESSION),
+       strategy(filter ? Z_FILTERED : Z_DEFAULT_STRATEGY) {
+      
+         if (compression == FastCompression) {
+            level = Z_BEST_SPEED;
+         }
+         else if (compression == SmallCompression) {
+            level = Z_BEST_COMPRESSION;
+         }
       }
    
-   /*virtual*/ 
-       unsigned char PaethFilter::Unfilter(unsigned char filtered) {
-      // PNG spec says:
-      //	Paeth(x) = Raw(x) - 
-      //		PaethPredictor(Raw(x-bpp), Prior(x), Prior(x-bpp))
-      // So,
-      //	Raw(x) = Paeth(x) + PaethPredictor(...)
-         unsigned char aboveLeft	= 0;
-         if (aboveLeftRaw_) {
-            aboveLeft = *aboveLeftRaw_;
-         }
-         unsigned char above	= 0;
-         if (aboveRaw_) {
-            above = *aboveRaw_;
-            aboveLeftRaw_ = aboveRaw_++;
-         }
-         unsigned char raw = 0xFF & (static_cast<int>(filtered) +
-            PaethPredictor(leftRaw_, above, aboveLeft));
-         leftRaw_		= raw;
-         return raw;
-      }// PaethFilter::Unfilter
-   
-   /*static*/ 
-       int PaethFilter::PaethPredictor(
-       int left, int above, int aboveLeft) {
-      // Translated from pseudocode in PNG spec.
-         int initialEstimate		= left + above - aboveLeft;
-         int leftDistance		= abs(initialEstimate - left);
-         int aboveDistance		= abs(initialEstimate - above);
-         int aboveLeftDistance	= abs(initialEstimate - aboveLeft);
-      
-      // Return nearest of left, above or aboveLeft, breaking ties in order
-      // left, above, aboveLeft.
-         if (leftDistance <= aboveDistance && 
-         leftDistance <= aboveLeftDistance) {
-            return left;
-         } 
-         else if (aboveDistance <= aboveLeftDistance) {
-            return above;
-         } 
-         else {
-            return aboveLeft;
+       unsigned char ScanlineFilter::Choose(
+       const unsigned char* row, const unsigned char* prior) {
+         unsigned char best = PassThruFilterCode;
+         unsigned bestSum = UINT_MAX;
+         for (unsigned char code = PassThruFilterCode; 
+         code <= PaethFilterCode; ++code) {
+            unsigned sum = FilterScanline(code, &filtered_[code * width_], 
+               row, prior, width_);
+            if (sum < bestSum) {
+               best = code;
+               bestSum = sum;
+            }
          }
-      }// PaethFilter::PaethPredictor
+         return best;
+      }// ScanlineFilter::Choose
+   
+   // Parallel compression -------------------------------------------------
+   
+   // From zlib's later adler32_combine. An Adler-32 checksum is two sums 
+   // modulo 65521: A, one plus the sum of the bytes, and B, the sum of 
+   // the values A takes after each byte. Appending n bytes with sums A2 
+   // and B2 adds A2 - 1 to A, and to B adds B2 plus n times the first A 
+   // less n, which becomes B2 - n.
+       MiniPNG_UInt32 CombineAdler32(MiniPNG_UInt32 first, 
+       MiniPNG_UInt32 second, unsigned long secondLength) {
+         unsigned long const Base = 65521;
+      
+         unsigned long const remainder = secondLength % Base;
+         unsigned long sum1 = first & 0xFFFF;
+         unsigned long sum2 = (remainder * sum1) % Base;
+         sum1 += (second & 0xFFFF) + Base - 1;
+         sum2 += ((first >> 16) & 0xFFFF) + ((second >> 16) & 0xFFFF) + 
+            Base - remainder;
+         if (sum1 >= Base) sum1 -= Base;
+         if (sum1 >= Base) sum1 -= Base;
+         if (sum2 >= (Base << 1)) sum2 -= (Base << 1);
+         if (sum2 >= Base) sum2 -= Base;
+         return (MiniPNG_UInt32)(sum1 | (sum2 << 16));
+      }// CombineAdler32
+   
+       void CompressStripe(void* context) {
+         IDATStripe& stripe = *static_cast<IDATStripe*>(context);
+         try {
+            CompressionSettings const settings(stripe.compression);
+            Compressor compressor(settings.level, settings.strategy, true);
+            ScanlineFilter filter(stripe.width);
+            uLong adler = adler32(0L, Z_NULL, 0);
+         
+            const unsigned char* prior = stripe.prior;
+            const unsigned char* row = stripe.pixels;
+            for (unsigned y = 0; y < stripe.rows; ++y) {
+               unsigned char code = PassThruFilterCode;
+               const unsigned char* bytes = row;
+               if (settings.filter) {
+                  code = filter.Choose(row, prior);
+                  bytes = filter.GetFiltered(code);
+               }
+               compressor.Compress(code);
+               compressor.Compress(bytes, stripe.width);
+               adler = adler32(adler, &code, 1);
+               adler = adler32(adler, bytes, stripe.width);
+               prior = row;
+               row += stripe.width;
+            }
+            if (stripe.last) {
+               compressor.Finish();
+            }
+            else {
+               compressor.Flush();
+            }
+         
+            stripe.data.assign(compressor.GetDstPtr(), 
+               compressor.GetDstPtr() + compressor.GetDstLength());
+            stripe.adler = (MiniPNG_UInt32)adler;
+         }
+             catch (error const& e) {
+               stripe.failure = e.message();
+            }
+             catch (std::exception const& e) {
+               stripe.failure = std::string("CompressStripe failed: ") + 
+                  e.what();
+            }
+      }// CompressStripe
    
    // BufferedZLibStream ---------------------------------------------------
    
@@ -642,8 +923,12 @@ extern "C"{
          zStm_.opaque	= (voidpf)0;
       }// BufferedZLibStream ctor
    
-       void BufferedZLibStream::CompressInit() {
-         int err = deflateInit(&zStm_, Z_DEFAULT_COMPRESSION);
+       void BufferedZLibStream::CompressInit(int level, int strategy, 
+       bool raw) {
+      // 8 is zlib's default memory level; a negative window size leaves
+      // out the header and trailer.
+         int err = deflateInit2(&zStm_, level, Z_DEFLATED, 
+            raw ? -MAX_WBITS : MAX_WBITS, 8, strategy);
          if (Z_OK != err) {
             throw error(
                "deflateInit failed in BufferdZLibStream::CompressInit.");
@@ -686,21 +971,46 @@ extern "C"{
          }
       }// BufferedZLibStream::Compress
    
+       void BufferedZLibStream::CompressFlush() {
+         PrepareStream(0, 0);
+      
+      // The flush is complete once deflate leaves room in the buffer. If
+      // it happened to fill the buffer exactly, the next call has nothing
+      // to do and says so with Z_BUF_ERROR.
+         do {
+            if (0 == zStm_.avail_out) {
+               GrowDstBuffer();
+            }
+            uLong oldTotalOut = zStm_.total_out;
+            int err = deflate(&zStm_, Z_SYNC_FLUSH);
+            writeOffset_ += zStm_.total_out - oldTotalOut;
+            if (err == Z_BUF_ERROR) {
+               break;
+            }
+            if (err != Z_OK) {
+               throw error(
+                  "deflate failed in BufferedZLibStream::CompressFlush.");
+            }
+         } while (0 == zStm_.avail_out);
+      }// BufferedZLibStream::CompressFlush
+   
        void BufferedZLibStream::CompressFinish() {
          PrepareStream(0, 0);
       
+      // Compress may have left the buffer exactly full, and deflate 
+      // refuses to run with no room at all.
          bool moreOutput = true;
          do {
+            if (0 == zStm_.avail_out) {
+               GrowDstBuffer();
+            }
             uLong oldTotalOut = zStm_.total_out;
             int err = deflate(&zStm_, Z_FINISH);
             writeOffset_ += zStm_.total_out - oldTotalOut;
             if (err == Z_STREAM_END) {
                moreOutput = false;
             } 
-            else if (err == Z_OK) {
-               GrowDstBuffer();
-            } 
-            else {
+            else if (err != Z_OK) {
                throw error(
                   "deflate failed in BufferedZLibStream::CompressFinish.");
             }
@@ -842,9 +1152,7 @@ extern "C"{
       }// PNGWriter::operator()
    
        void PNGWriter::WriteSignature() {
-         for (unsigned i = 0; i < PngSignatureByteCount; ++i) {
-            WriteByte(*stm_, PngSignature[i]);
-         }
+         WriteBuffer(*stm_, PngSignature, PngSignatureByteCount);
       }// PNGWriter::WriteSignature
    
        void PNGWriter::WriteIHDRChunk() {
@@ -870,22 +1178,49 @@ extern "C"{
       }// PNGWriter::WritePLTEChunk
    
        void PNGWriter::WriteIDATChunks() {
-         Compressor compressor;
+      // Big enough images are shared among threads when asked.
+         unsigned long const bytes = (unsigned long)(width_ + 1) * height_;
+         unsigned long stripes = threads_ > 0 ? threads_ 
+            : studentgraphics::detail::ProcessorCount();
+         if (stripes > bytes / MinStripeBytes) {
+            stripes = bytes / MinStripeBytes;
+         }
+         if (stripes > 1) {
+            WriteIDATChunksInStripes(stripes);
+            return;
+         }
+      
+         CompressionSettings const settings(compression_);
+         Compressor compressor(settings.level, settings.strategy);
+         ScanlineFilter filter(width_);
+      // The image need not keep a scanline once the next is asked for, so
+      // filtering works from a copy of the one before.
+         Buffer priorScanline(width_, 0);
       
-      // Write IDAT chunks. One per scanline except for empty chunks.
+      // Write IDAT chunks of at least IDATChunkSize bytes, except for the
+      // last.
          for (unsigned y = 0; y < height_; ++y) {
-         // Compress scanline with filter style 0: none (PassThruFilter).
             const unsigned char* curPixel = image_->GetScanline(y);
-            compressor.Compress(static_cast<unsigned char>(0));	
-            compressor.Compress(curPixel, width_);
+            if (settings.filter) {
+               unsigned char code = 
+                  filter.Choose(curPixel, &priorScanline[0]);
+               compressor.Compress(code);
+               compressor.Compress(filter.GetFiltered(code), width_);
+               memcpy(&priorScanline[0], curPixel, width_);
+            }
+            else {
+               compressor.Compress(static_cast<unsigned char>(
+                  PassThruFilterCode));
+               compressor.Compress(curPixel, width_);
+            }
          
             if (y == height_ - 1) {
             // Final scanline: output compression stream postscript.
                compressor.Finish();
             }
          
-            if (compressor.GetDstLength()) {
-            // Write compressed scanline to an IDAT chunk.
+            if (compressor.GetDstLength() >= IDATChunkSize ||
+            (y == height_ - 1 && compressor.GetDstLength())) {
                PNGChunkWriter writer(
                   *stm_, compressor.GetDstLength(), IDATChunkType);
             
@@ -896,6 +1231,84 @@ extern "C"{
          }// for( y...
       }// PNGWriter::WriteIDATChunks
    
+   // The same zlib stream as WriteIDATChunks makes, built pigz fashion: the
+   // image is cut into stripes of rows, compressed at once on threads of 
+   // their own, and their output put together behind a zlib header, 
+   // followed by the stripes' Adler-32 checksums combined. Each stripe 
+   // starts with an empty dictionary, so the file is a little bigger 
+   // than a serial encode would make it.
+       void PNGWriter::WriteIDATChunksInStripes(unsigned stripes) {
+      // The scanlines are copied first, as the image need only keep one 
+      // at a time.
+         Buffer pixels((unsigned long)width_ * height_);
+         for (unsigned y = 0; y < height_; ++y) {
+            memcpy(&pixels[(unsigned long)width_ * y], image_->GetScanline(y),
+               width_);
+         }
+         Buffer const zeros(width_, 0);
+      
+         std::vector<IDATStripe> parts(stripes);
+         std::vector<void*> contexts(stripes);
+         for (unsigned i = 0; i < stripes; ++i) {
+            unsigned const top = 
+               (unsigned)((unsigned long)height_ * i / stripes);
+            unsigned const bottom = 
+               (unsigned)((unsigned long)height_ * (i + 1) / stripes);
+            IDATStripe& part = parts[i];
+            part.pixels = &pixels[(unsigned long)width_ * top];
+            part.prior = top ? part.pixels - width_ : &zeros[0];
+            part.width = width_;
+            part.rows = bottom - top;
+            part.compression = compression_;
+            part.last = i == stripes - 1;
+            part.adler = 1;
+            contexts[i] = &part;
+         }
+         studentgraphics::detail::RunConcurrently(
+            CompressStripe, &contexts[0], stripes);
+         for (unsigned i = 0; i < stripes; ++i) {
+            if (!parts[i].failure.empty()) {
+               throw error(parts[i].failure);
+            }
+         }
+      
+      // The zlib header gives deflate with a 32K window and then the 
+      // level as zlib would, with check bits making the pair of bytes a
+      // multiple of 31. The trailer is the checksum, most significant
+      // byte first.
+         unsigned const levelFlags = compression_ == FastCompression ? 0 
+            : compression_ == SmallCompression ? 3 : 2;
+         unsigned header = ((Z_DEFLATED + ((MAX_WBITS - 8) << 4)) << 8) |
+            (levelFlags << 6);
+         header += 31 - header % 31;
+      
+         Buffer stream;
+         stream.push_back((unsigned char)(header >> 8));
+         stream.push_back((unsigned char)(header & 0xFF));
+         MiniPNG_UInt32 adler = 1;
+         for (unsigned i = 0; i < stripes; ++i) {
+            stream.insert(stream.end(), parts[i].data.begin(), 
+               parts[i].data.end());
+            Buffer().swap(parts[i].data);
+            adler = CombineAdler32(adler, parts[i].adler, 
+               (unsigned long)(width_ + 1) * parts[i].rows);
+         }
+         stream.push_back((unsigned char)((adler >> 24) & 0xFF));
+         stream.push_back((unsigned char)((adler >> 16) & 0xFF));
+         stream.push_back((unsigned char)((adler >> 8) & 0xFF));
+         stream.push_back((unsigned char)(adler & 0xFF));
+      
+         for (unsigned long at = 0; at < stream.size(); at += IDATChunkSize) {
+            unsigned long length = stream.size() - at;
+            if (length > IDATChunkSize) {
+               length = IDATChunkSize;
+            }
+            PNGChunkWriter writer(*stm_, length, IDATChunkType);
+            writer.Write(&stream[at], length);
+            writer.End();
+         }
+      }// PNGWriter::WriteIDATChunksInStripes
+   
        void PNGWriter::WriteIENDChunk() {
          PNGChunkWriter writer(*stm_, IENDChunkLength, IENDChunkType);
          writer.End();
@@ -907,7 +1320,7 @@ extern "C"{
          stm_		= &stm;
          image_		= &image;
          chunksRead_	= 0;
-         curY_		= -1;
+         curY_		= 0;
          imageDone_	= false;
       
          WritableImageSentry sentry(image);
@@ -1033,10 +1446,11 @@ extern "C"{
       
          image_->SetImageInfo(ImageInfo(width_, height_));
       
-      // Initialise members for first image data read.
-         rawScanline_.resize(width_);
-         rawPriorScanline_.resize(width_);
-         endRaw_ = curRaw_ = rawScanline_.begin();
+      // Initialise members for first image data read. The topmost
+      // scanline is unfiltered against a scanline of zeros.
+         rawScanline_.assign(width_ + 1, 0);
+         rawPriorScanline_.assign(width_ + 1, 0);
+         scanlineFill_ = 0;
       }// PNGReader::ReadIHDRChunk
    
        void PNGReader::ReadPLTEChunk(PNGChunkReader& reader) {
@@ -1056,7 +1470,7 @@ extern "C"{
       }// PNGReader::ReadPLTEChunk
    
        void PNGReader::ReadIDATChunk(PNGChunkReader& reader) {
-         assert(rawScanline_.size() == width_);
+         assert(rawScanline_.size() == width_ + 1);
       
       // Decompress chunk.
          MiniPNG_UInt32 compLength = reader.GetLength();
@@ -1064,66 +1478,38 @@ extern "C"{
          reader.Read(&compBuffer_[0], compLength);
          decompressor_.Decompress(&compBuffer_[0], compLength);
       
-      // Unfilter decompressed chunk data, including interpreting start-of-
-      // scanline filter code bytes.
+      // Gather the decompressed data into scanlines, each starting with its
+      // filter code byte, and unfilter and hand over each as it completes.
          const unsigned char*	cur = decompressor_.GetDstPtr();
          const unsigned char*	end = cur + decompressor_.GetDstLength();
+         unsigned const scanlineLength = width_ + 1;
          while (cur != end) {
-            if (curRaw_ == endRaw_) {
-            // Reached start of next scanline.
-               if (++curY_ == (int)height_) {
-               // Prevent buffer overrun.
-                  throw error(
-                     "PNGWriter::ReadIDATChunk found too many pixels.");
-               }
-            
+            if (imageDone_) {
+            // Prevent buffer overrun.
+               throw error(
+                  "PNGReader::ReadIDATChunk found too many pixels.");
+            }
+         
+            unsigned count = scanlineLength - scanlineFill_;
+            if (unsigned(end - cur) < count) {
+               count = end - cur;
+            }
+            memcpy(&rawScanline_[scanlineFill_], cur, count);
+            cur += count;
+            scanlineFill_ += count;
+         
+            if (scanlineFill_ == scanlineLength) {
+               UnfilterScanline(rawScanline_[0], &rawScanline_[1], 
+                  &rawPriorScanline_[1], width_);
+               image_->SetScanline(curY_, &rawScanline_[1]);
                rawScanline_.swap(rawPriorScanline_);
-               curRaw_ = rawScanline_.begin();
-               endRaw_	= rawScanline_.end();
-            
-            // Read filter byte.
-               switch (*cur) {
-                  case PassThruFilterCode:
-                     curFilter_ = &passThruFilter_;
-                     break;
-               
-                  case SubFilterCode:
-                     curFilter_ = &subFilter_;
-                     break;
-               
-                  case UpFilterCode:
-                     curFilter_ = &upFilter_;
-                     break;
-               
-                  case AverageFilterCode:
-                     curFilter_ = &averageFilter_;
-                     break;
-               
-                  case PaethFilterCode:
-                     curFilter_ = &paethFilter_;
-                     break;
-               }// switch (filter code)
-            
-               const unsigned char* prior = 0;
-               if (curY_) {
-                  prior = &rawPriorScanline_[0];
-                  image_->SetScanline(curY_ - 1, prior);
+               scanlineFill_ = 0;
+               if (MiniPNG_UInt32(++curY_) == height_) {
+                  imageDone_ = true;
                }
-               curFilter_->BeginScanline(prior);
-            } 
-            else {
-            // Normal pixel byte.
-               *curRaw_++ = curFilter_->Unfilter(*cur);
             }
-            ++cur;
          }// while (cur != end)
       
-         if (curRaw_ == endRaw_ && (MiniPNG_UInt32)curY_ == (height_ - 1)) {
-         // Write final scanline.	
-            image_->SetScanline(curY_, &rawScanline_[0]);
-            imageDone_ = true;
-         }
-      
          decompressor_.ClearDst();
       }// ReadIDATChunk
    
@@ -1150,27 +1536,25 @@ extern "C"{
    
    // CRCCalculator --------------------------------------------------------
    
-   /*static*/ bool	CRCCalculator::tableInitDone_ = false;
-   /*static*/ MiniPNG_UInt32	
-      CRCCalculator::table_[CRCCalculator::TableEntryCount];
+   /*static*/ CRCCalculator::Table const	CRCCalculator::table_;
+   
+       CRCCalculator::Table::Table() {
+      // Initialise CRC lookup table.
+         for (unsigned n = 0; n < TableEntryCount; ++n) {
+            MiniPNG_UInt32 c = n;
+            for (unsigned k = 0; k < 8; ++k) {
+               if (c & 1) {
+                  c = 0xEDB88320 ^ (c >> 1);
+               } 
+               else {
+                  c >>= 1;
+               }
+            }// for (k...
+            entries[n] = c;
+         }// for (n...
+      }// CRCCalculator::Table ctor.
    
        CRCCalculator::CRCCalculator() : runningCRC_(0xFFFFFFFF) {
-         if (!tableInitDone_) {
-         // Initialise CRC lookup table.
-            for (unsigned n = 0; n < TableEntryCount; ++n) {
-               MiniPNG_UInt32 c = n;
-               for (unsigned k = 0; k < 8; ++k) {
-                  if (c & 1) {
-                     c = 0xEDB88320 ^ (c >> 1);
-                  } 
-                  else {
-                     c >>= 1;
-                  }
-               }// for (k...
-               table_[n] = c;
-            }// for (n...
-            tableInitDone_ = true;
-         }// if (!tableInitDone_)
       }// CRCCalculator ctor.
    
        void CRCCalculator::Append(const unsigned char* buf, unsigned len) {
@@ -1179,7 +1563,7 @@ extern "C"{
       
          const unsigned char* lim = buf + len;
          while (buf != lim) {
-            c = table_[(c ^ *buf++) & 0xFF] ^ (c >> 8);
+            c = table_.entries[(c ^ *buf++) & 0xFF] ^ (c >> 8);
          }
       
          runningCRC_ = c;
@@ -1289,33 +1673,72 @@ extern "C"{
          reader(stm, image);
       }
    
-       void SavePNG(ReadableImage& image, std::ostream& stm) {
-         PNGWriter writer;
+       void SavePNG(ReadableImage& image, std::ostream& stm, 
+       Compression compression, int threads) {
+         PNGWriter writer(compression, threads);
          writer(stm, image);
       }
    
-       void LoadPlaypen(studentgraphics::playpen& p, std::istream& stm) {
+   // PlaypenWritableImage -------------------------------------------------
+   
+   /*virtual*/ 
+       void PlaypenWritableImage::SetImageInfo(const ImageInfo& info) {
          using namespace studentgraphics;
       
-         SimpleImage image(0, 0);
-         LoadPNG(image, stm);
-      
-         ImageInfo info = image.GetImageInfo();
-         if (info.GetWidth() != (unsigned)Xpixels || info.GetHeight() != (unsigned)Ypixels) {
+         if (info.GetWidth() != (unsigned)p_.width() || 
+         info.GetHeight() != (unsigned)p_.height()) {
             throw playpen::exception(playpen::exception::error,
                "LoadPlaypen found loaded image was wrong size.");
          }
+      }
+   
+   /*virtual*/ 
+       void PlaypenWritableImage::SetPaletteEntry(
+       unsigned index, const PaletteEntry& entry) {
       
-         for (unsigned i = 0; i < colours; ++i) {
-            PaletteEntry entry = image.GetPaletteEntry(i);
-            p.setpalettentry(int(i), HueRGB(entry.red, entry.green, entry.blue));
-         }
+         assert(index <= 255);
+         p_.setpalettentry(int(index), 
+            studentgraphics::HueRGB(entry.red, entry.green, entry.blue));
+      }
+   
+   /*virtual*/ 
+       void PlaypenWritableImage::SetScanline(
+       unsigned y, const unsigned char* src) {
       
-         for (int y = 0; y < Ypixels; ++y) {
-            const unsigned char* cur = image.GetScanline(y);
-            for (int x = 0; x < Xpixels; ++x) {
-               p.setrawpixel(x, y, *cur++);
-            }
+         using studentgraphics::hue;
+         p_.setrawpixels(0, int(y), p_.width(), 1, 
+            static_cast<const hue*>(static_cast<const void*>(src)), 
+            p_.width());
+      }
+   
+   // PlaypenReadableImage -------------------------------------------------
+   
+   /*virtual*/ 
+       ImageInfo PlaypenReadableImage::GetImageInfo() {
+         return ImageInfo(p_.width(), p_.height());
+      }
+   
+   /*virtual*/ 
+       PaletteEntry PlaypenReadableImage::GetPaletteEntry(unsigned index) {
+         assert(index <= 255);
+         studentgraphics::HueRGB hueRGB = p_.getpalettentry(int(index));
+         PaletteEntry entry = {hueRGB.r, hueRGB.g, hueRGB.b};
+         return entry;
+      }
+   
+   /*virtual*/ 
+       const unsigned char* PlaypenReadableImage::GetScanline(unsigned y) {
+         return static_cast<const unsigned char*>(
+            static_cast<const void*>(p_.getrawrow(int(y))));
+      }
+   
+   // Free functions for playpens ------------------------------------------
+   
+       void LoadPlaypen(studentgraphics::playpen& p, std::istream& stm) {
+         PlaypenWritableImage image(p);
+         {
+            PLAYPEN_TIME(png_decode_seconds);
+            LoadPNG(image, stm);
          }
       
          p.updatepalette();
@@ -1323,27 +1746,12 @@ extern "C"{
       }// LoadPlaypen
    
    
-       void SavePlaypen(studentgraphics::playpen const & p, std::ostream& stm) {
-         using namespace studentgraphics;
-      
-         SimpleImage image(Xpixels, Ypixels);
+       void SavePlaypen(studentgraphics::playpen const & p, std::ostream& stm,
+       Compression compression, int threads) {
+         PlaypenReadableImage image(p);
       
-         for (unsigned i = 0; i < colours; ++i) {
-            HueRGB			hueRGB	= p.getpalettentry(int(i));
-            PaletteEntry	entry	= {hueRGB.r, hueRGB.g, hueRGB.b};
-            image.SetPaletteEntry(i, entry);
-         }
-      
-         std::vector<palettecode> scanline(Xpixels);
-         for (int y = 0; y < Ypixels; ++y) {
-            std::vector<palettecode>::iterator cur = scanline.begin();
-            for (int x = 0; x < Xpixels; ++x) {
-               *cur++ = p.getrawpixel(x, y);
-            }
-            image.SetScanline(y, &scanline[0]);
-         }
-      
-         SavePNG(image, stm);
+         PLAYPEN_TIME(png_encode_seconds);
+         SavePNG(image, stm, compression, threads);
       }// SavePlaypen
    
    }// namespace MiniPNG
@@ -1356,12 +1764,103 @@ extern "C"{
          infile.close();
       }	 		   
    
+      namespace {
+         MiniPNG::Compression const compressionSettings[] = {
+            MiniPNG::FastCompression, 
+            MiniPNG::DefaultCompression, 
+            MiniPNG::SmallCompression};
+      
+         int saveQueueDepth = 2;
+      
+      // A save queued by SavePlaypenAsync: its own copy of the canvas and
+      // palette, and where and how to write them.
+          struct BackgroundSave {
+             explicit BackgroundSave(playpen const & p) : 
+             image(p.width(), p.height()) {}
+         
+            MiniPNG::SimpleImage	image;
+            std::string				filename;
+            MiniPNG::Compression	compression;
+            save_done				done;
+            void*					context;
+         };
+      
+      // Returns what went wrong, or an empty string if nothing did.
+          std::string WriteSave(BackgroundSave& save) {
+            try {
+               std::ofstream outfile(save.filename.c_str(), std::ios::binary);
+               if (!outfile) {
+                  return "Cannot provide access to output file in SavePlaypenAsync";
+               }
+               MiniPNG::SavePNG(save.image, outfile, save.compression);
+               outfile.close();
+               if (!outfile) {
+                  return "Cannot finish writing output file in SavePlaypenAsync";
+               }
+            }
+                catch (MiniPNG::error const & e) {
+                  return e.message();
+               }
+                catch (std::exception const & e) {
+                  return e.what();
+               }
+            return std::string();
+         }
+      
+      // RunInBackground job for SavePlaypenAsync, which owns the save.
+          void WriteInBackground(void* context) {
+            BackgroundSave* save = static_cast<BackgroundSave*>(context);
+            std::string const failure = WriteSave(*save);
+            if (save->done) {
+               save->done(save->filename, failure, save->context);
+            }
+            delete save;
+         }
+      }
+   
    // overload for public use to prevent problems with not opening stream in binary mode
    
-       void SavePlaypen(playpen const & p, std::string filename) {
+       void SavePlaypen(playpen const & p, std::string filename, 
+       png_compression compression, int threads) {
          std::ofstream outfile(filename.c_str(), std::ios::binary);
          if(!outfile)throw MiniPNG::error("Cannot provide access to output file in SavePlaypen");
-         MiniPNG::SavePlaypen(p, outfile);
+         MiniPNG::SavePlaypen(p, outfile, compressionSettings[compression], 
+            threads);
          outfile.close();
       }	 	 	 	 
+   
+       void SavePlaypenAsync(playpen const & p, std::string filename, 
+       save_done done, void * context, png_compression compression) {
+         BackgroundSave* save = new BackgroundSave(p);
+         try {
+            MiniPNG::PlaypenReadableImage source(p);
+            for (int y = 0; y < p.height(); ++y) {
+               save->image.SetScanline(y, source.GetScanline(y));
+            }
+            for (unsigned i = 0; i < 256; ++i) {
+               save->image.SetPaletteEntry(i, source.GetPaletteEntry(i));
+            }
+            save->filename = filename;
+            save->compression = compressionSettings[compression];
+            save->done = done;
+            save->context = context;
+            detail::RunInBackground(WriteInBackground, save, saveQueueDepth);
+         }
+             catch (...) {
+               delete save;
+               throw;
+            }
+      }
+   
+       void WaitForSaves() {
+         detail::WaitForBackground();
+      }
+   
+       void SetSaveQueueDepth(int n) {
+         saveQueueDepth = n > 1 ? n : 1;
+      }
+   
+       int SaveQueueDepth() {
+         return saveQueueDepth;
+      }
    } // end namespace studentgraphics
@@ -237,6 +237,55 @@ namespace MiniPNG {
 		PixelBuffer		pixels_;	
 	};// class SimpleImage
 
+	// Adapters that let LoadPNG and SavePNG work directly on a playpen's
+	// raw pixels and palette, with no copy of the image in between: each
+	// scanline goes straight from the decoder into the canvas, or straight
+	// from the canvas into the encoder. LoadPlaypen and SavePlaypen use
+	// them.
+	//
+	// Notes:
+	// 1. The image must be the same size as the playpen; loading one that
+	//	is not throws a playpen::exception before anything has changed.
+	// 2. Loading changes the palette entries but does not update the 
+	//	physical palette or the display.
+	class PlaypenWritableImage : public WritableImage {
+	public:
+		explicit PlaypenWritableImage(studentgraphics::playpen& p) : p_(p) {}
+		virtual void BeginWrite() {}
+		virtual void SetImageInfo(const ImageInfo& info);
+		virtual void SetPaletteEntry(
+			unsigned index, const PaletteEntry& entry);
+		virtual void SetScanline(unsigned y, const unsigned char* src);
+		virtual void EndWrite(bool) {}
+
+	private:
+		studentgraphics::playpen& p_;
+	};// class PlaypenWritableImage
+
+	class PlaypenReadableImage : public ReadableImage {
+	public:
+		explicit PlaypenReadableImage(const studentgraphics::playpen& p) : p_(p) {}
+		virtual void BeginRead() {}
+		virtual ImageInfo GetImageInfo();
+		virtual PaletteEntry GetPaletteEntry(unsigned index);
+		virtual const unsigned char* GetScanline(unsigned y);
+		virtual void EndRead(bool) {}
+
+	private:
+		const studentgraphics::playpen& p_;
+	};// class PlaypenReadableImage
+
+	// How SavePNG trades time against file size. FastCompression leaves 
+	// the scanlines unfiltered and uses zlib's quickest level. 
+	// DefaultCompression filters each scanline whichever way leaves the
+	// smallest differences, at zlib's default level; SmallCompression 
+	// does the same at zlib's best level.
+	enum Compression {
+		FastCompression,
+		DefaultCompression,
+		SmallCompression
+	};
+
 	// The free functions may throw this exception to indicate PNG specific
 	// errors, as well as the usual memory and I/O related exceptions.
 	class error {
@@ -266,10 +315,17 @@ namespace MiniPNG {
 	//						be read.
 	//	[in, out] stm - The stream to which the image will be saved. The
 	//					stream must be opened in binary mode.
+	//	[in] compression -	How hard to work at making the file small.
+	//	[in] threads -	How many threads may share the compression: 1 keeps
+	//					it on the calling thread and 0 means one per 
+	//					processor. Each thread is given a stripe of at 
+	//					least 256 KiB of the image, so small images are
+	//					compressed on one whatever is asked.
 	// Exceptions:
 	//	May throw. Basic guarantee: if it does throw, the stream and image
 	//	have valid but indeterminate state.
-	void SavePNG(ReadableImage& image, std::ostream& stm);
+	void SavePNG(ReadableImage& image, std::ostream& stm, 
+		Compression compression = DefaultCompression, int threads = 1);
 
 
 
@@ -0,0 +1,117 @@
+#include "offscreen.h"
+#include "plot_kernels.h"
+#include <algorithm>
+
+namespace studentgraphics {
+	offscreen::offscreen(hue background)
+		: xsize(Xpixels), ysize(Ypixels), pixels(xsize * ysize, background),
+		pmode(direct), xorg(xsize/2), yorg(ysize/2){}
+
+	offscreen::offscreen(int width, int height, hue background)
+		: xsize(width), ysize(height), pixels(), pmode(direct),
+		xorg(width/2), yorg(height/2){
+		if(width <= 0 or height <= 0){
+			throw playpen::exception(playpen::exception::error,
+				"offscreen width and height must be positive.");
+		}
+		pixels.assign(xsize * ysize, background);
+	}
+
+	offscreen& offscreen::plot(int x, int y, hue h){
+		int const s(pixsize.size());
+		if(s != 1){
+			fill_raw(xorg + x*s, yorg - y*s - s + 1, xorg + x*s + s - 1, yorg - y*s, h);
+			return *this;
+		}
+		x += xorg;
+		y = yorg - y;
+		if(x < 0 or x >= xsize or y < 0 or y >= ysize) return *this;
+		hue & p(pixels[y * xsize + x]);
+		switch(pmode){
+		case direct:	p = h; break;
+		case filter:	p = hue(h & p); break;
+		case additive:	p = hue(h | p); break;
+		case disjoint:	p = hue(h ^ p); break;
+		}
+		return *this;
+	}
+
+	offscreen& offscreen::plot_span(int x, int y, int length, hue h){
+		return fill_rect(x, y, length, 1, h);
+	}
+
+	offscreen& offscreen::fill_rect(int x, int y, int width, int height, hue h){
+		if(width <= 0 or height <= 0) return *this;
+		int const s(pixsize.size());
+		int const left(xorg + x*s);
+		int const bottom(yorg - y*s);
+		fill_raw(left, bottom - height*s + 1, left + width*s - 1, bottom, h);
+		return *this;
+	}
+
+	offscreen& offscreen::plot_points(playpen::point const * pts, int n, hue h){
+		for(int k(0); k < n; ++k) plot(pts[k].x, pts[k].y, h);
+		return *this;
+	}
+
+	hue offscreen::get_hue(int x, int y)const{
+		x = x*pixsize.size() + xorg;
+		y = yorg - y*pixsize.size();
+		if(x < 0 or x >= xsize or y < 0 or y >= ysize) return black;
+		return pixels[y * xsize + x];
+	}
+
+	plotmode offscreen::setplotmode(plotmode pm){
+		plotmode was(pmode);
+		pmode = pm;
+		return was;
+	}
+
+	offscreen& offscreen::clear(hue h){
+		std::fill(pixels.begin(), pixels.end(), h);
+		return *this;
+	}
+
+	hue offscreen::getrawpixel(int x, int y) const {
+		if(x < 0 or x >= xsize or y < 0 or y >= ysize){
+			throw playpen::exception(playpen::exception::error,
+				"Co-ordinates out of range in offscreen::getrawpixel.");
+		}
+		return pixels[y * xsize + x];
+	}
+
+	void offscreen::setrawpixel(int x, int y, hue h){
+		if(x < 0 or x >= xsize or y < 0 or y >= ysize) return;
+		pixels[y * xsize + x] = h;
+	}
+
+	offscreen const& offscreen::present(playpen & p) const {
+		p.setrawpixels(0, 0, xsize, ysize, &pixels[0], xsize);
+		return *this;
+	}
+
+	offscreen const& offscreen::blit(playpen & p, int x, int y, int width, int height,
+						int to_x, int to_y) const {
+	// clip against this surface, the playpen clips against itself
+		if(x < 0){ width += x; to_x -= x; x = 0; }
+		if(y < 0){ height += y; to_y -= y; y = 0; }
+		if(x + width > xsize) width = xsize - x;
+		if(y + height > ysize) height = ysize - y;
+		if(width > 0 and height > 0){
+			p.setrawpixels(to_x, to_y, width, height, &pixels[y * xsize + x], xsize);
+		}
+		return *this;
+	}
+
+// left, top, right and bottom are raw and all included.
+	void offscreen::fill_raw(int left, int top, int right, int bottom, hue h){
+		if(left < 0) left = 0;
+		if(top < 0) top = 0;
+		if(right >= xsize) right = xsize - 1;
+		if(bottom >= ysize) bottom = ysize - 1;
+		if(left > right or top > bottom) return;
+		for(int y(top); y <= bottom; ++y){
+			detail::CombineSpan(&pixels[y * xsize + left], right - left + 1, h, pmode);
+		}
+	}
+}
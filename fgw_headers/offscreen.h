@@ -0,0 +1,64 @@
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include "playpen.h"
+#include <vector>
+
+namespace studentgraphics {
+	// A drawing surface like a playpen but with its own pixels, so that
+	// the next frame (or a background that never changes) can be drawn
+	// while the playpen shows something else. It has the
+	// drawing functions of playpen; nothing reaches the playpen until
+	// present() or blit() copies it there, and nothing is visible until
+	// the playpen's display() is called.
+	class offscreen {
+	public:
+		// Xpixels by Ypixels, the size of a default playpen.
+		explicit offscreen(hue background = white);
+		offscreen(int width, int height, hue background = white);
+		// Compiler generated copying and destruction are OK.
+
+		offscreen&		plot(int x, int y, hue h);
+		offscreen&		plot(double x, double y, hue h){return plot(int(x+0.5), int(y+0.5), h);}
+		offscreen&		plot_span(int x, int y, int length, hue h);
+		offscreen&		fill_rect(int x, int y, int width, int height, hue h);
+		offscreen&		plot_points(playpen::point const * pts, int n, hue h);
+		hue				get_hue(int x, int y)const;
+
+		plotmode		setplotmode(plotmode pm);
+		offscreen&		origin(int xval, int yval){xorg = xval; yorg = yval; return *this;}
+		playpen::origin_data origin()const {return playpen::origin_data(xorg, yorg);}
+		bool			scale(int i){return pixsize.size(i);}
+		int				scale()const {return pixsize.size();}
+		int				width()const {return xsize;}
+		int				height()const {return ysize;}
+		playpen::raw_pixel_data get_raw_xy(int i, int j){return playpen::raw_pixel_data(xorg+ i * pixsize.size(),
+																yorg - j * pixsize.size());}
+
+		offscreen&		clear(hue h = white);
+
+		// Ignore plotmode, origin and scaling, as for playpen.
+		hue getrawpixel(int x, int y) const;
+		void setrawpixel(int x, int y, hue h);
+
+		// Copy the whole surface onto the playpen, replacing what is there
+		// whatever the playpen's plotmode.
+		offscreen const&	present(playpen & p) const;
+		// Copy the width by height block of raw pixels whose top left is
+		// (x, y) so that it lands with its top left at raw (to_x, to_y) on
+		// the playpen. Anything falling off either surface is ignored.
+		offscreen const&	blit(playpen & p, int x, int y, int width, int height,
+								int to_x, int to_y) const;
+
+	private:
+		void fill_raw(int left, int top, int right, int bottom, hue h);
+
+		int xsize, ysize;
+		std::vector<hue> pixels;	// ysize rows of xsize
+		plotmode pmode;
+		int xorg, yorg;
+		pixelsize pixsize;
+	};
+}
+
+#endif
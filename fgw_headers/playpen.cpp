@@ -7,8 +7,15 @@
 // cstdlib correctly (some functions not in std that should be).
 #include <stdlib.h>		// For memset.
 #include <cassert>
+#include <math.h>
 #include <stdexcept>	// For std::bad_alloc.
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <string.h>		// For strcmp and memcpy.
 #include "playpen.h"
+#include "plot_kernels.h"
+#include "stats_counters.h"
 #include "mouse.h"
 #include "keyboard.h"	//Inserted 12/06/03
 
@@ -62,12 +69,67 @@
          rgbs[colours-1].r = rgbs[colours-1].g = rgbs[colours-1].b = 0xFF;	
       }// HueRGB256 ctor
    
-       struct Pixels {
-         hue p[Ypixels][Xpixels];
-          explicit Pixels(hue fillHue) { Clear(fillHue); }
+   // The window contents, with a record of which 32x32 tiles have
+   // changed since the last Display. Rows start on RowAlign boundaries,
+   // stride bytes apart.
+       struct Pixels : private CopyDisabler {
+         enum {
+            TileShift	= 5,
+            TileSize	= 1 << TileShift,
+            RowAlign	= 32
+         };
+         int const width;
+         int const height;
+         int const stride;
+         int const tilesAcross;
+         int const tilesDown;
+         std::vector<unsigned char> dirty;	// tilesDown rows of tilesAcross
+         bool anyDirty;
+          Pixels(int w, int h, hue fillHue) :
+          width(w), height(h),
+          stride((w + RowAlign - 1) / RowAlign * RowAlign),
+          tilesAcross((w + TileSize - 1) / TileSize),
+          tilesDown((h + TileSize - 1) / TileSize),
+          dirty(tilesAcross * tilesDown),
+          block_(malloc(stride * h + RowAlign - 1)) {
+            if (0 == block_) {
+               throw std::bad_alloc();
+            }
+            size_t const misalign = reinterpret_cast<size_t>(block_) & (RowAlign - 1);
+            data_ = static_cast<hue*>(block_) + (misalign ? RowAlign - misalign : 0);
+            Clear(fillHue);
+         }
+          ~Pixels() { free(block_); }
+          hue* Row(int y) { return data_ + y * stride; }
+          hue const* Row(int y) const { return data_ + y * stride; }
           void Clear(hue fillHue) {
-            memset(p[0], fillHue, Ypixels*Xpixels);
+            memset(data_, fillHue, stride * height);
+            MarkAllDirty();
          }
+          void MarkDirty(int x, int y) {
+            dirty[(y >> TileShift) * tilesAcross + (x >> TileShift)] = true;
+            anyDirty = true;
+         }
+      // All four edges are included and must be on the canvas.
+          void MarkDirty(int left, int top, int right, int bottom) {
+            for (int ty = top >> TileShift; ty <= bottom >> TileShift; ++ty) {
+               for (int tx = left >> TileShift; tx <= right >> TileShift; ++tx) {
+                  dirty[ty * tilesAcross + tx] = true;
+               }
+            }
+            anyDirty = true;
+         }
+          void MarkAllDirty() {
+            std::fill(dirty.begin(), dirty.end(), true);
+            anyDirty = true;
+         }
+          void ClearDirty() {
+            std::fill(dirty.begin(), dirty.end(), false);
+            anyDirty = false;
+         }
+      private:
+         void* block_;	// as allocated, data_ is aligned within it
+         hue* data_;
       };
    
    // Platform-specific code starts here.
@@ -283,6 +345,67 @@
          hThread_ = INVALID_HANDLE_VALUE;
       }// Thread::Join
    
+   // One call of a job on a thread of its own, for RunConcurrently and
+   // RunInBackground.
+      struct ConcurrentCall {
+         void (*job)(void*);
+         void* context;
+      };
+   
+       unsigned __stdcall ConcurrentCallForwarder(void* arg) {
+         ConcurrentCall* call = static_cast<ConcurrentCall*>(arg);
+         call->job(call->context);
+         return 0;
+      }
+   
+   // The jobs of RunInBackground and the thread that calls them, one at a
+   // time in order. Created with the first job and never destroyed, so
+   // that a job still running as the program ends never finds it gone.
+   // Each kind of waiter has an event of its own, set whenever what it
+   // waits for may have happened; waiters test again after every wake up.
+       struct BackgroundQueue {
+          BackgroundQueue() : busy(false) {}
+      
+         CriticalSection				lock;
+         Event						jobAdded;	// for the thread
+         Event						jobTaken;	// for RunInBackground
+         Event						idle;		// for WaitForBackground
+         std::deque<ConcurrentCall>	jobs;
+         bool						busy;		// a job has been taken
+         Thread						thread;
+      };
+   
+      BackgroundQueue* backgroundQueue = 0;
+   
+       unsigned __stdcall BackgroundForwarder(void* arg) {
+         BackgroundQueue& queue = *static_cast<BackgroundQueue*>(arg);
+         for (;;) {
+            ConcurrentCall call;
+            bool taken = false;
+            {
+               CSLocker lock(queue.lock);
+               if (queue.jobs.empty()) {
+                  queue.busy = false;
+               }
+               else {
+                  call = queue.jobs.front();
+                  queue.jobs.pop_front();
+                  queue.busy = true;
+                  taken = true;
+               }
+            }
+            if (taken) {
+               queue.jobTaken.Set();
+               call.job(call.context);
+            }
+            else {
+               queue.idle.Set();
+               queue.jobAdded.WaitFor(INFINITE);
+            }
+         }
+         return 0;
+      }
+   
       int const LogPaletteVersion     = 0x0300; // Has to be this value.
    
    // RAII wrapper around HPALETTE.
@@ -758,6 +881,8 @@
       
       // Parameters are not cached. To update display after changes call
       // Display() and/or UpdatePalette().
+      // When IsHeadless() no window or worker thread is created, Display()
+      // and UpdatePalette() do nothing and there is no input.
          SingletonWindowImpl(Pixels const & pixels, HueRGB256 const & hueRGBs);
       
          ~SingletonWindowImpl();
@@ -795,6 +920,9 @@
       // Called by either thread. Requires sharedStateLock_ is already held.
          void Draw(HDC hDC, RECT const * rect = 0);
       
+         bool					headless_;
+         int						width_;
+         int						height_;
          Thread					thread_;
          int						key_;  // inserted 12/06/03
          HWND					hWnd_;
@@ -815,6 +943,9 @@
    
        SingletonWindowImpl::SingletonWindowImpl(
        Pixels const & pixels, HueRGB256 const & hueRGBs) :
+       headless_(IsHeadless()),
+       width_(pixels.width),
+       height_(pixels.height),
        key_(0),		// inserted 12/06/03
        hWnd_(0),
        palette_(hueRGBs),
@@ -822,12 +953,17 @@
        mouseButtonDown_(false) {
       
          mouseLocation_.x(-1); mouseLocation_.y(-1);	  // Outside window.
+         if (headless_) {
+            return;
+         }
       
       // Initialize bitmap.
          {
             DCLocker dcLocker(0);	// Get screen DC.
             PaletteSelection ps(palette_, dcLocker.GetHDC());
-            bitmap_.Reset(dcLocker.GetHDC(), Xpixels, Ypixels, pixels.p[0]);
+         // The bitmap is stride pixels wide so that GDI steps through the
+         // rows exactly as Pixels lays them out; only width are shown.
+            bitmap_.Reset(dcLocker.GetHDC(), pixels.stride, height_, pixels.Row(0));
          }
       
       // Start a worker thread to create the play pen window and run its
@@ -841,21 +977,33 @@
       // Send a WM_CLOSE message, which in turn sends a WM_DESTROY message,
       // which in turn *posts* (i.e. asynchronous) a WM_QUIT message, then
       // wait for the worker thread to completely finish. 
+         if (headless_) {
+            return;
+         }
          SendMessage(hWnd_, WM_CLOSE, 0, 0);
          thread_.Join(DestroyTimeout);
       }
    
+   // GDI is given the whole bitmap, but only if something has changed.
        void SingletonWindowImpl::Display(Pixels const & pixels){
+         if (headless_ || !pixels.anyDirty) {
+            return;
+         }
          CSLocker lock(sharedStateLock_);
          CheckForPendingException();
          DCLocker dcLocker(hWnd_);
          PaletteSelection ps(palette_, dcLocker.GetHDC());
-         bitmap_.SetBits(dcLocker.GetHDC(), pixels.p[0]);
+         bitmap_.SetBits(dcLocker.GetHDC(), pixels.Row(0));
          Draw(dcLocker.GetHDC());
+         PLAYPEN_COUNT(requests, 2);
+         PLAYPEN_COUNT(bytes_uploaded, (unsigned long)pixels.stride * height_);
       }
    
        void SingletonWindowImpl::UpdatePalette(Pixels const & pixels, 
        									HueRGB256 const & hueRGBs) {
+         if (headless_) {
+            return;
+         }
          CSLocker lock(sharedStateLock_);
          CheckForPendingException();
          palette_.SetEntries(hueRGBs);
@@ -865,8 +1013,10 @@
       // change the physical palette (could be running in true colour
       // mode for a start), so we need to recreate the device-depenedent
       // bitmap and draw the window at this point.
-         bitmap_.SetBits(dcLocker.GetHDC(), pixels.p[0]);
+         bitmap_.SetBits(dcLocker.GetHDC(), pixels.Row(0));
          Draw(dcLocker.GetHDC(), 0);
+         PLAYPEN_COUNT(requests, 2);
+         PLAYPEN_COUNT(bytes_uploaded, (unsigned long)pixels.stride * height_);
       }
    					
        mouse::location SingletonWindowImpl::GetMouseLocation() const {
@@ -914,11 +1064,11 @@
             WindowClass windowClass(wc);
          
          // Create a window with size
-         // Y:	desired client size (Ypixels) + caption + 2 borders
-         // X:	desired client width (Xpixels) + 2 borders
+         // Y:	desired client size (height_) + caption + 2 borders
+         // X:	desired client width (width_) + 2 borders
             int requiredHeight = GetSystemMetrics(SM_CYCAPTION) + 
-               			 GetSystemMetrics(SM_CYFIXEDFRAME)*2 + Ypixels;
-            int requiredWidth  = GetSystemMetrics(SM_CXFIXEDFRAME)*2 + Xpixels;
+               			 GetSystemMetrics(SM_CYFIXEDFRAME)*2 + height_;
+            int requiredWidth  = GetSystemMetrics(SM_CXFIXEDFRAME)*2 + width_;
             instance_ = this;
             hWnd_ = CreateWindow(WindowClassName, "Playpen", WS_OVERLAPPED, 
                CW_USEDEFAULT, CW_USEDEFAULT, requiredWidth, requiredHeight, 
@@ -1042,7 +1192,7 @@
          CSLocker	lock(sharedStateLock_);
       
          POINT	clientPt	= {x, y};
-         RECT	clientRect	= {0, 0, Xpixels, Ypixels};
+         RECT	clientRect	= {0, 0, width_, height_};
          POINT   screenPt	= {x, y};
       
          if (!ClientToScreen(hWnd_, &screenPt)) {
@@ -1146,7 +1296,7 @@
          }
          else
          {
-            BitBlt(hDC, 0, 0, Xpixels, Ypixels, memDC.GetHDC(), 
+            BitBlt(hDC, 0, 0, width_, height_, memDC.GetHDC(), 
                0, 0, SRCCOPY);
          }
       }// SingletonWindowImpl::Draw
@@ -1158,12 +1308,145 @@
       ::Sleep(ms);
    }
 
+    double studentgraphics::MonotonicTime() {
+      LARGE_INTEGER frequency, now;
+      QueryPerformanceFrequency(&frequency);
+      QueryPerformanceCounter(&now);
+      return double(now.QuadPart) / double(frequency.QuadPart);
+   }
+
+// Sleep only has millisecond resolution, so stop within a millisecond of
+// the deadline rather than spin.
+    void studentgraphics::WaitUntil(double deadline) {
+      for (;;) {
+         double const left = deadline - MonotonicTime();
+         if (left < 0.001) {
+            return;
+         }
+         ::Sleep(DWORD(left * 1000));
+      }
+   }
+
+// Platform-specific support for the parallel flood fill.
+    int studentgraphics::detail::ProcessorCount() {
+      SYSTEM_INFO info;
+      GetSystemInfo(&info);
+      return info.dwNumberOfProcessors > 0 ? int(info.dwNumberOfProcessors) : 1;
+   }
+
+// The calling thread does the first job, so n - 1 threads are started.
+    void studentgraphics::detail::RunConcurrently(void (*job)(void*), 
+                                                  void* const* contexts, int n) {
+      std::vector<ConcurrentCall> calls(n);
+      Thread* threads = new Thread[n];
+      for (int i = 1; i < n; ++i) {
+         calls[i].job = job;
+         calls[i].context = contexts[i];
+         threads[i].Run(ConcurrentCallForwarder, &calls[i]);
+      }
+      job(contexts[0]);
+      for (int i = 1; i < n; ++i) {
+         threads[i].Join(INFINITE);
+      }
+      delete [] threads;
+   }
+
+// Platform-specific support for background saving.
+    void studentgraphics::detail::RunInBackground(void (*job)(void*), 
+                                                  void* context, int queueLimit) {
+      if (!backgroundQueue) {
+         backgroundQueue = new BackgroundQueue;
+         backgroundQueue->thread.Run(BackgroundForwarder, backgroundQueue);
+      }
+      BackgroundQueue& queue = *backgroundQueue;
+      for (;;) {
+         {
+            CSLocker lock(queue.lock);
+            if (int(queue.jobs.size()) < queueLimit) {
+               ConcurrentCall call;
+               call.job = job;
+               call.context = context;
+               queue.jobs.push_back(call);
+               break;
+            }
+         }
+         queue.jobTaken.WaitFor(INFINITE);
+      }
+      queue.jobAdded.Set();
+   }
+
+    void studentgraphics::detail::WaitForBackground() {
+      if (!backgroundQueue) {
+         return;
+      }
+      BackgroundQueue& queue = *backgroundQueue;
+      for (;;) {
+         {
+            CSLocker lock(queue.lock);
+            if (queue.jobs.empty() && !queue.busy) {
+               return;
+            }
+         }
+         queue.idle.WaitFor(INFINITE);
+      }
+   }
+
 
 // Plaform-specific code ends here. From now on it's platform
 // independent code until the end of the file.
 
 
    namespace studentgraphics {
+
+    // Window options. -1 until decided, either by the Set function or
+    // from the environment variable the first time anyone asks.
+      namespace {
+         int headlessMode = -1;
+         int asyncDisplayMode = -1;
+         int fillThreads = -1;
+      
+       // Set to anything but empty or 0 counts as on.
+          bool EnvironmentFlag(char const * name) {
+            char const * env = getenv(name);
+            return env != 0 && *env != '\0' && strcmp(env, "0") != 0;
+         }
+      }
+   
+       void SetHeadless(bool on) {
+         headlessMode = on;
+      }
+   
+       bool IsHeadless() {
+         if (headlessMode < 0) {
+            headlessMode = EnvironmentFlag("PLAYPEN_HEADLESS");
+         }
+         return headlessMode != 0;
+      }
+   
+    // This version always draws synchronously; the setting is kept only
+    // so that programs using it stay portable.
+       void SetAsyncDisplay(bool on) {
+         asyncDisplayMode = on;
+      }
+   
+       bool IsAsyncDisplay() {
+         if (asyncDisplayMode < 0) {
+            asyncDisplayMode = EnvironmentFlag("PLAYPEN_ASYNC_DISPLAY");
+         }
+         return asyncDisplayMode != 0;
+      }
+   
+       void SetFillThreads(int n) {
+         fillThreads = n > 0 ? n : detail::ProcessorCount();
+      }
+   
+       int FillThreads() {
+         if (fillThreads < 0) {
+            char const * env = getenv("PLAYPEN_FILL_THREADS");
+            SetFillThreads(env != 0 && *env != '\0' ? atoi(env) : 1);
+         }
+         return fillThreads;
+      }
    
       namespace detail {
       
@@ -1177,17 +1460,43 @@
           class SingletonWindow : private CopyDisabler {
          public:
          // These two control lifetime of singleton using reference count.
-            static SingletonWindow*	GetWindow(hue background);
+         // A width or height of 0 accepts whatever size the window
+         // already has (Xpixels by Ypixels for a new one).
+            static SingletonWindow*	GetWindow(hue background,
+            									int width = 0, int height = 0);
             void					ReleaseWindow();
          
          // Drawing functions.
             void	Plot(int x, int y, hue, plotmode);
-             void	Display() { impl_.Display(pixels_); }
+            // Plot every pixel from (left, top) to (right, bottom), all
+            // edges included. Anything off the canvas is ignored.
+            void	FillRect(int left, int top, int right, int bottom, hue, plotmode);
+            // Copy a width by height block of pixels whose rows are stride
+            // apart to (left, top), clipped to the canvas.
+            void	CopyIn(int left, int top, int width, int height,
+                           hue const * src, int stride);
+            // Plot the line from (x0, y0) towards (x1, y1), the end point
+            // excluded. Only the part on the canvas is stepped.
+            void	Line(int x0, int y0, int x1, int y1, hue, plotmode);
+            // Change the pixels around (x, y) that pass test to the hue; see
+            // detail::FloodFill. Nothing happens off the canvas.
+            void	FillRegion(int x, int y, FillTest const &, hue);
+            // Recolour the pixels from (left, top) to (right, bottom), edges
+            // included: those of hue from become to, or each pixel p becomes
+            // table[p]. Anything off the canvas is ignored.
+            void	Replace(int left, int top, int right, int bottom,
+                            hue from, hue to);
+            void	Remap(int left, int top, int right, int bottom,
+                          unsigned char const * table);
+            // Label the canvas's regions; see detail::LabelRegions.
+            unsigned	Label(bool eightConnected, unsigned * labels,
+                           std::vector<playpen::region> &);
+            void	Display();
             void 	Clear();
             void	Clear(hue);
          
          // Palette handling.
-             void    UpdatePalette() { impl_.UpdatePalette(pixels_, hueRGBs_); }
+            void	UpdatePalette();
             void	SetPaletteEntry(hue, HueRGB const &);
             HueRGB 	GetPaletteEntry(hue);
          
@@ -1197,6 +1506,10 @@
          
          // GSL: Added for MiniPNG support.
             hue GetPixel(int x, int y) const;
+            hue const * GetRow(int y) const;
+         
+            int Width() const { return pixels_.width; }
+            int Height() const { return pixels_.height; }
          
          // GSL: Added for mouse support.
              mouse::location GetMouseLocation() const 
@@ -1214,7 +1527,11 @@
          private:
          // Public interface to construction/destruction is GetWindow/
          // ReleaseWindow.
-            SingletonWindow(hue);
+            SingletonWindow(hue, int width, int height);
+         
+         // Clip a rectangle to the canvas; false if nothing is left.
+            bool	ClipToCanvas(int & left, int & top, int & right,
+            					 int & bottom) const;
          
          // Construction order of impl_ relative to other members is 
          // important. DO NOT CHANGE.
@@ -1222,6 +1539,10 @@
             HueRGB256			hueRGBs_;
             SingletonWindowImpl	impl_;
             hue 				background_;
+            std::vector<FillSpan>	fillStack_;
+            std::vector<FillBand>	fillBands_;
+            std::vector<LabelRun>	labelRuns_;
+            std::vector<unsigned>	labelParents_;
          
             static unsigned			refCount_;
             static SingletonWindow*	instance_;
@@ -1233,13 +1554,40 @@
           void SingletonWindow::Clear(){ pixels_.Clear(background_);}
           void SingletonWindow::Clear(hue h){ pixels_.Clear(h);}
       
-          SingletonWindow* SingletonWindow::GetWindow(hue background) {
+          void SingletonWindow::Display() {
+            {
+               PLAYPEN_TIME(display_seconds);
+               PLAYPEN_COUNT(display_calls, 1);
+               impl_.Display(pixels_);
+               pixels_.ClearDirty();
+            }
+            PLAYPEN_DUMP_STATS();
+         }
+      
+      // A new palette changes the look of every pixel.
+          void SingletonWindow::UpdatePalette() {
+            PLAYPEN_TIME(palette_seconds);
+            pixels_.MarkAllDirty();
+            impl_.UpdatePalette(pixels_, hueRGBs_);
+            pixels_.ClearDirty();
+         }
+      
+          SingletonWindow* SingletonWindow::GetWindow(hue background,
+          									int width, int height) {
             if (0 == refCount_) {
-               instance_ = new SingletonWindow(background);
+               instance_ = new SingletonWindow(background,
+               						width ? width : Xpixels,
+               						height ? height : Ypixels);
                if (!instance_) { // Support MSVC6 non-standard new behaviour.
                   throw std::bad_alloc();
                }
             }	 
+            else if ((width && width != instance_->Width())
+            		|| (height && height != instance_->Height())) {
+            // There is only one window to share.
+               throw playpen::exception(playpen::exception::error,
+                  "A playpen of a different size already exists.");
+            }
             ++refCount_;
             return instance_;
          }
@@ -1251,37 +1599,196 @@
             }
          }
       
-          SingletonWindow::SingletonWindow(hue background) :
-          pixels_(background),
+          SingletonWindow::SingletonWindow(hue background, int width, int height) :
+          pixels_(width, height, background),
           impl_(pixels_, hueRGBs_),
-          background_(background) {}
+          background_(background) {
+            pixels_.ClearDirty();
+            fillStack_.reserve(4 * height);
+         }
       
       // Simply set the appropriate location in the array.
           void SingletonWindow::Plot(int x, int y, hue c, plotmode pm) {
-            if (x < 0 || x >= Xpixels) 
+            if (x < 0 || x >= pixels_.width) {
+               PLAYPEN_COUNT(pixels_clipped, 1);
                return; // if out of bounds, ignore
-            if (y < 0 || y >= Ypixels) 
+            }
+            if (y < 0 || y >= pixels_.height) {
+               PLAYPEN_COUNT(pixels_clipped, 1);
                return; // i.e. it is not an error
+            }
          // the above is cleanest here as it allows easy scaling at top level
+            hue & p = pixels_.Row(y)[x];
             switch (pm) {
-               case direct:	pixels_.p[y][x] = c;	
+               case direct:	p = c;	
                   break;
-               case filter:	pixels_.p[y][x] = hue(c & pixels_.p[y][x]);	 
+               case filter:	p = hue(c & p);	 
                   break;
-               case additive:	pixels_.p[y][x] = hue(c | pixels_.p[y][x]);	
+               case additive:	p = hue(c | p);	
                   break;
-               case disjoint:	pixels_.p[y][x] = hue(c ^ pixels_.p[y][x]);   
+               case disjoint:	p = hue(c ^ p);   
                   break;
             }
+            PLAYPEN_COUNT(pixels_plotted, 1);
+            pixels_.MarkDirty(x, y);
          }     
+
+        // Clip once, then work along whole rows.
+          void SingletonWindow::FillRect(int left, int top, int right,
+                                         int bottom, hue c, plotmode pm) {
+            unsigned long const wanted = RectArea(left, top, right, bottom);
+            if (left < 0) left = 0;
+            if (top < 0) top = 0;
+            if (right >= pixels_.width) right = pixels_.width - 1;
+            if (bottom >= pixels_.height) bottom = pixels_.height - 1;
+            unsigned long const plotted = RectArea(left, top, right, bottom);
+            PLAYPEN_COUNT(pixels_plotted, plotted);
+            PLAYPEN_COUNT(pixels_clipped, wanted - plotted);
+            if (plotted == 0) 
+               return;
+            for (int y = top; y <= bottom; ++y) {
+               CombineSpan(pixels_.Row(y) + left, right - left + 1, c, pm);
+            }
+            pixels_.MarkDirty(left, top, right, bottom);
+         }
+
+        // Clip the line to the canvas once, then step along it in the
+        // pixel buffer a tile's length at a time so that only the tiles
+        // it crosses are marked dirty.
+          void SingletonWindow::Line(int x0, int y0, int x1, int y1,
+                                     hue c, plotmode pm) {
+            LineSteps line(x0, y0, x1, y1);
+            int const wanted = line.count;
+            line.Clip(0, 0, pixels_.width - 1, pixels_.height - 1);
+            PLAYPEN_COUNT(pixels_plotted, line.count);
+            PLAYPEN_COUNT(pixels_clipped, wanted - line.count);
+            while (line.count > 0) {
+               int const n = line.count < Pixels::TileSize 
+                  ? line.count : int(Pixels::TileSize);
+               int const fromX = line.x;
+               int const fromY = line.y;
+               CombineLine(pixels_.Row(0), pixels_.stride, line, n, c, pm);
+               // line.x, line.y is now one step past the last pixel
+               int left = fromX < line.x ? fromX : line.x;
+               int right = fromX < line.x ? line.x : fromX;
+               int top = fromY < line.y ? fromY : line.y;
+               int bottom = fromY < line.y ? line.y : fromY;
+               if (left < 0) left = 0;
+               if (top < 0) top = 0;
+               if (right >= pixels_.width) right = pixels_.width - 1;
+               if (bottom >= pixels_.height) bottom = pixels_.height - 1;
+               pixels_.MarkDirty(left, top, right, bottom);
+            }
+         }
+
+        // The span stack and bands are kept from one fill to the next so
+        // that their storage is only allocated once.
+          void SingletonWindow::FillRegion(int x, int y, FillTest const & test,
+                                           hue c) {
+            if (x < 0 || x >= pixels_.width || y < 0 || y >= pixels_.height) 
+               return;
+            int left, top, right, bottom;
+            int const threads = FillThreads();
+            int const filled = threads > 1 
+               && pixels_.width * pixels_.height >= ParallelFillPixels
+               ? ParallelFloodFill(pixels_.Row(0), pixels_.stride,
+                                   pixels_.width, pixels_.height, x, y,
+                                   test, c, threads, fillBands_,
+                                   left, top, right, bottom)
+               : FloodFill(pixels_.Row(0), pixels_.stride,
+                           pixels_.width, pixels_.height, x, y,
+                           test, c, fillStack_,
+                           left, top, right, bottom);
+            PLAYPEN_COUNT(pixels_plotted, filled);
+            if (filled) 
+               pixels_.MarkDirty(left, top, right, bottom);
+         }
+
+        // Both work row by row on the clipped rectangle, marking dirty
+        // only the stretch of each row that actually changed.
+          void SingletonWindow::Replace(int left, int top, int right,
+                                        int bottom, hue from, hue to) {
+            if (!ClipToCanvas(left, top, right, bottom)) 
+               return;
+            for (int y = top; y <= bottom; ++y) {
+               int first, last;
+               if (ReplaceSpan(pixels_.Row(y) + left, right - left + 1,
+                               from, to, first, last)) 
+                  pixels_.MarkDirty(left + first, y, left + last, y);
+            }
+         }
+      
+          void SingletonWindow::Remap(int left, int top, int right,
+                                      int bottom, unsigned char const * table) {
+            if (!ClipToCanvas(left, top, right, bottom)) 
+               return;
+            for (int y = top; y <= bottom; ++y) {
+               int first, last;
+               if (RemapSpan(pixels_.Row(y) + left, right - left + 1,
+                             table, first, last)) 
+                  pixels_.MarkDirty(left + first, y, left + last, y);
+            }
+         }
+      
+        // Like fillStack_ the labeller's working space is kept for reuse.
+          unsigned SingletonWindow::Label(bool eightConnected, unsigned * labels,
+                                          std::vector<playpen::region> & regions) {
+            return LabelRegions(pixels_.Row(0), pixels_.stride, pixels_.width,
+                                pixels_.height, eightConnected, labels, regions,
+                                labelRuns_, labelParents_);
+         }
+      
+        // Counts the pixels kept and lost as FillRect does.
+          bool SingletonWindow::ClipToCanvas(int & left, int & top,
+                                             int & right, int & bottom) const {
+            unsigned long const wanted = RectArea(left, top, right, bottom);
+            if (left < 0) left = 0;
+            if (top < 0) top = 0;
+            if (right >= pixels_.width) right = pixels_.width - 1;
+            if (bottom >= pixels_.height) bottom = pixels_.height - 1;
+            unsigned long const kept = RectArea(left, top, right, bottom);
+            PLAYPEN_COUNT(pixels_plotted, kept);
+            PLAYPEN_COUNT(pixels_clipped, wanted - kept);
+            return kept != 0;
+         }
+      
+        // Clip the block against the canvas and copy what is left row by
+        // row.
+          void SingletonWindow::CopyIn(int left, int top, int width, int height,
+                                       hue const * src, int stride) {
+            unsigned long const wanted = 
+               RectArea(left, top, left + width - 1, top + height - 1);
+            if (left < 0) { width += left; src -= left; left = 0; }
+            if (top < 0) { height += top; src -= top * stride; top = 0; }
+            if (left + width > pixels_.width) width = pixels_.width - left;
+            if (top + height > pixels_.height) height = pixels_.height - top;
+            unsigned long const copied = 
+               RectArea(left, top, left + width - 1, top + height - 1);
+            PLAYPEN_COUNT(pixels_plotted, copied);
+            PLAYPEN_COUNT(pixels_clipped, wanted - copied);
+            if (copied == 0) 
+               return;
+            for (int y = 0; y != height; ++y) {
+               memcpy(pixels_.Row(top + y) + left, src + y * stride, width);
+            }
+            pixels_.MarkDirty(left, top, left + width - 1, top + height - 1);
+         }
       
       // GSL: Added for MiniPNG support.
           hue SingletonWindow::GetPixel(int x, int y) const {
-            if (x < 0 || x >= Xpixels || y < 0 || y >= Ypixels) {
+            if (x < 0 || x >= pixels_.width || y < 0 || y >= pixels_.height) {
                throw playpen::exception(playpen::exception::error,
                   "Co-ordinates out of range in SingletonWindow::GetPixel.");
             }
-            return pixels_.p[y][x];
+            return pixels_.Row(y)[x];
+         }
+      
+          hue const * SingletonWindow::GetRow(int y) const {
+            if (y < 0 || y >= pixels_.height) {
+               throw playpen::exception(playpen::exception::error,
+                  "Row out of range in SingletonWindow::GetRow.");
+            }
+            return pixels_.Row(y);
          }
       
           void SingletonWindow::SetPaletteEntry(hue h, HueRGB const & rgb) {
@@ -1292,16 +1799,56 @@
             return hueRGBs_.rgbs[h];	
          }
       
+      // A save starts with SaveMagic and the canvas's width and height,
+      // which Restore checks before changing anything. Files from before
+      // the header have none and start with the background; Restore takes
+      // those only on a canvas of the default size they were saved from.
+         namespace {
+            char const SaveMagic[4] = {'F', 'G', 'W', 'P'};
+         }
+      
           ostream& SingletonWindow::Save(ostream & out) {
+            out.write(SaveMagic, sizeof(SaveMagic));
+            out.write((char*)&pixels_.width, sizeof(pixels_.width));
+            out.write((char*)&pixels_.height, sizeof(pixels_.height));
             out.write((char*)&background_, sizeof(background_));
             out.write((char*)&hueRGBs_, sizeof(hueRGBs_)); 
-            out.write((char*)pixels_.p[0], sizeof(hue)*Xpixels*Ypixels);
+            for (int y = 0; y != pixels_.height; ++y) {
+               out.write((char*)pixels_.Row(y), sizeof(hue)*pixels_.width);
+            }
             return out;
          }
           istream& SingletonWindow::Restore(istream & inp){
-            inp.read((char*)&background_, sizeof(background_));
-            inp.read((char*)&hueRGBs_, sizeof(hueRGBs_));
-            inp.read((char*)pixels_.p[0], sizeof(hue)*Xpixels*Ypixels);
+         // the background and palette, read whole before either is set
+            char head[sizeof(background_) + sizeof(hueRGBs_)];
+            char magic[sizeof(SaveMagic)];
+            inp.read(magic, sizeof(magic));
+            if (inp && memcmp(magic, SaveMagic, sizeof(magic)) == 0) {
+               int width = 0;
+               int height = 0;
+               inp.read((char*)&width, sizeof(width));
+               inp.read((char*)&height, sizeof(height));
+               if (width != pixels_.width || height != pixels_.height) {
+                  inp.setstate(std::ios::failbit);
+               }
+               inp.read(head, sizeof(head));
+            }
+            else if (pixels_.width != Xpixels || pixels_.height != Ypixels) {
+               inp.setstate(std::ios::failbit);
+            }
+            else {
+            // a file without the header: magic was the start of head
+               memcpy(head, magic, sizeof(magic));
+               inp.read(head + sizeof(magic), sizeof(head) - sizeof(magic));
+            }
+            if (!inp) {
+               return inp;
+            }
+            memcpy(&background_, head, sizeof(background_));
+            memcpy(&hueRGBs_, head + sizeof(background_), sizeof(hueRGBs_));
+            for (int y = 0; y != pixels_.height; ++y) {
+               inp.read((char*)pixels_.Row(y), sizeof(hue)*pixels_.width);
+            }
             UpdatePalette();
             Display();
             return inp;
@@ -1315,13 +1862,27 @@
    // The one SingletonWindow shared by all playpen objects.
       /*static*/ detail::SingletonWindow *  playpen::graphicswindow = 0;
    
-       playpen::playpen(hue background) : pmode(direct),xorg(Xpixels/2), yorg(Ypixels/2) {
+       playpen::playpen(hue background) : pmode(direct) {
          graphicswindow = detail::SingletonWindow::GetWindow(background);
          if (!graphicswindow) {
             throw playpen::exception(playpen::exception::fatal, 
                "Could not get window handle in playpen constructor.");
          }
+         xorg = graphicswindow->Width()/2;
+         yorg = graphicswindow->Height()/2;
          rgbpalette();     	 
+      }
+       playpen::playpen(int w, int h, hue background) : pmode(direct), xorg(w/2), yorg(h/2) {
+         if (w <= 0 || h <= 0) {
+            throw playpen::exception(playpen::exception::error, 
+               "Playpen width and height must be positive.");
+         }
+         graphicswindow = detail::SingletonWindow::GetWindow(background, w, h);
+         if (!graphicswindow) {
+            throw playpen::exception(playpen::exception::fatal, 
+               "Could not get window handle in playpen constructor.");
+         }
+         rgbpalette();
       }
        playpen::playpen(playpen const & pp): pmode(pp.pmode), xorg(pp.xorg), yorg(pp.yorg) {
          graphicswindow = detail::SingletonWindow::GetWindow(black);
@@ -1336,6 +1897,15 @@
          graphicswindow->ReleaseWindow();	
       }
    
+   // The size of the canvas in pixels, as the window has it.
+       int playpen::width() const {
+         return graphicswindow->Width();
+      }
+   
+       int playpen::height() const {
+         return graphicswindow->Height();
+      }
+   
    // Allows the plotmode state to be changed. Might consider making that part of
    // the state of a playpen rather than of the SingletonWindow instance	  
        plotmode playpen::setplotmode(plotmode pm){
@@ -1349,9 +1919,14 @@
          out.write((char*)this, sizeof(this));
          return graphicswindow->Save(out);
       }
+   // The playpen's own bytes are only copied in once the window has
+   // accepted the stream, so a mismatched one leaves this as it was.
        istream & playpen::restore(istream & inp) {
-         inp.read((char*)this, sizeof(this));
-         return graphicswindow->Restore(inp);
+         char state[sizeof(this)];
+         if (inp.read(state, sizeof(state)) && graphicswindow->Restore(inp)) {
+            memcpy((char*)this, state, sizeof(state));
+         }
+         return inp;
       }
    
        playpen const & playpen::display() const {
@@ -1374,6 +1949,102 @@
          }	   	   
          return *this;
       }
+
+    // Bulk plotting: work out the raw rectangle covered by the logical
+    // pixels once and let SingletonWindow clip and fill it.
+       playpen& playpen::plot_span(int x, int y, int length, hue c){
+         return fill_rect(x, y, length, 1, c);
+      }
+   
+       playpen& playpen::fill_rect(int x, int y, int width, int height, hue c){
+         if (width <= 0 || height <= 0) 
+            return *this;
+         int const s = pixsize.size();
+         int const left = xorg + x*s;
+         int const bottom = yorg - y*s;
+         graphicswindow->FillRect(left, bottom - height*s + 1,
+                                  left + width*s - 1, bottom, c, pmode);
+         return *this;
+      }
+   
+    // Recolouring: the logical rectangle becomes a raw one as in fill_rect.
+       playpen& playpen::replace_all(hue from, hue to){
+         graphicswindow->Replace(0, 0, width() - 1, height() - 1, from, to);
+         return *this;
+      }
+   
+       playpen& playpen::replace_all(hue from, hue to,
+                                     int x, int y, int width, int height){
+         if (width <= 0 || height <= 0) 
+            return *this;
+         int const s = pixsize.size();
+         int const left = xorg + x*s;
+         int const bottom = yorg - y*s;
+         graphicswindow->Replace(left, bottom - height*s + 1,
+                                 left + width*s - 1, bottom, from, to);
+         return *this;
+      }
+   
+       playpen& playpen::remap(unsigned char const table[256]){
+         graphicswindow->Remap(0, 0, width() - 1, height() - 1, table);
+         return *this;
+      }
+   
+       playpen& playpen::remap(unsigned char const table[256],
+                               int x, int y, int width, int height){
+         if (width <= 0 || height <= 0) 
+            return *this;
+         int const s = pixsize.size();
+         int const left = xorg + x*s;
+         int const bottom = yorg - y*s;
+         graphicswindow->Remap(left, bottom - height*s + 1,
+                               left + width*s - 1, bottom, table);
+         return *this;
+      }
+   
+       playpen& playpen::plot_points(point const * pts, int n, hue c){
+         int const s = pixsize.size();
+         if (s == 1) {
+            for (int k = 0; k < n; ++k) {
+               graphicswindow->Plot(xorg + pts[k].x, yorg - pts[k].y, c, pmode);
+            }
+         }
+         else {
+            for (int k = 0; k < n; ++k) {
+               int const left = xorg + pts[k].x*s;
+               int const bottom = yorg - pts[k].y*s;
+               graphicswindow->FillRect(left, bottom - s + 1, left + s - 1,
+                                        bottom, c, pmode);
+            }
+         }
+         return *this;
+      }
+   
+    // At scale 1 the line goes straight to the pixel buffer. Otherwise it
+    // is stepped in logical pixels, clipped to those whose blocks touch
+    // the canvas, and each block is filled.
+       playpen& playpen::plot_line(int x0, int y0, int x1, int y1, hue c){
+         int const s = pixsize.size();
+         if (s == 1) {
+            graphicswindow->Line(xorg + x0, yorg - y0, xorg + x1, yorg - y1,
+                                 c, pmode);
+            return *this;
+         }
+         detail::LineSteps line(x0, y0, x1, y1);
+         int const width = graphicswindow->Width();
+         int const height = graphicswindow->Height();
+         line.Clip(int(floor(double(-xorg) / s)), 
+                   int(floor(double(yorg - height + 1) / s)),
+                   int(floor(double(width - 1 - xorg) / s)), 
+                   int(floor(double(yorg) / s)));
+         for (; line.count > 0; line.Step()) {
+            int const left = xorg + line.x*s;
+            int const bottom = yorg - line.y*s;
+            graphicswindow->FillRect(left, bottom - s + 1, left + s - 1,
+                                     bottom, c, pmode);
+         }
+         return *this;
+      }
    
    // 12/12/02 function to return hue of pixel allowing for origin and scale. FGW
        hue playpen::get_hue(int x, int y)const{
@@ -1422,9 +2093,40 @@
          return graphicswindow->GetPixel(x, y);
       }
    
+       hue const * playpen::getrawrow(int y) const {
+         return graphicswindow->GetRow(y);
+      }
+   
        void playpen::setrawpixel(int x, int y, hue h) {
          graphicswindow->Plot(x, y, h, direct);
       }
+
+       void playpen::setrawpixels(int x, int y, int width, int height,
+                                  hue const * src, int stride) {
+         graphicswindow->CopyIn(x, y, width, height, src, stride);
+      }
+   
+       void playpen::fillrawregion(int x, int y, hue h, hue boundary) {
+         detail::FillTest const test = {boundary, h, false};
+         graphicswindow->FillRegion(x, y, test, h);
+      }
+   
+       void playpen::replacerawregion(int x, int y, hue h) {
+         if (x < 0 || x >= width() || y < 0 || y >= height()) 
+            return;
+         hue const old = getrawpixel(x, y);
+         if (old == h) 
+            return;
+         detail::FillTest const test = {old, old, true};
+         graphicswindow->FillRegion(x, y, test, h);
+      }
+   
+       unsigned playpen::labelrawregions(std::vector<unsigned> & labels,
+                                         std::vector<region> & regions,
+                                         bool eight_connected) const {
+         labels.resize(std::size_t(width()) * height());
+         return graphicswindow->Label(eight_connected, &labels[0], regions);
+      }
    
    // mouse class.
    
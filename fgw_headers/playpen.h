@@ -19,6 +19,7 @@
 #include <bitset>
 #include <iostream>
 #include <string>
+#include <vector>
 
 
 namespace studentgraphics {
@@ -35,6 +36,38 @@ namespace studentgraphics {
 
 	// Wrapper for OS-specific sleep function.
     void Wait(unsigned ms);
+	// Seconds from some fixed moment, on a clock that is never set back
+	// or forward, and a sleep until that clock reaches deadline.
+	double MonotonicTime();
+	void WaitUntil(double deadline);
+
+	// Headless running: no window is opened, display() does nothing and
+	// there is no mouse or keyboard input, but drawing, the palette and
+	// Load/SavePlaypen work as usual. Setting the environment variable
+	// PLAYPEN_HEADLESS (to anything but 0) has the same effect as calling
+	// SetHeadless(true). The choice is taken when the first playpen is
+	// created and holds until the last one has been destroyed.
+	void SetHeadless(bool on);
+	bool IsHeadless();
+
+	// Asynchronous display: display() copies the changed pixels and
+	// returns at once, leaving the window's own thread to draw them. If
+	// display() is called again before that has happened the earlier
+	// frame is simply replaced. Also turned on by PLAYPEN_ASYNC_DISPLAY,
+	// and chosen when the window is created as for SetHeadless. (Only the
+	// X Window version draws asynchronously; on Windows display() always
+	// finishes drawing before it returns.)
+	void SetAsyncDisplay(bool on);
+	bool IsAsyncDisplay();
+
+	// Parallel flood fills: on canvases of half a million pixels or more
+	// seed_fill and replace_hue share each fill among n threads, with the
+	// same result. 1, the default, keeps every fill on the calling thread
+	// and 0 means a thread per processor. PLAYPEN_FILL_THREADS sets the
+	// number too. Unlike the window options this can be changed at any
+	// time.
+	void SetFillThreads(int n);
+	int FillThreads();
 
 	namespace detail {	
 		// Forward declare the class that provides the OS specific code
@@ -90,7 +123,7 @@ namespace studentgraphics {
 	hue const blue1(1);
 	hue const torquoise(1);
 	inline istream & operator >> (istream & in , hue & shade){
-		shade = (std::cin == in ? fgw::read<int>() : fgw::read<int>(in));
+		shade = (&std::cin == &in ? fgw::read<int>() : fgw::read<int>(in));
 		return in;
 	}
 	
@@ -110,6 +143,7 @@ namespace studentgraphics {
 	};
 
 	unsigned int const colours = 0x100;	// number of colours in palette
+	// The size of a playpen unless another is asked for.
 	int const Xpixels = 512;	// pixels across
 	int const Ypixels = 512;	// pixels down
 	// plotmode determines the way source and destination hues are combined 
@@ -159,6 +193,10 @@ namespace studentgraphics {
 		
 		
 		playpen(hue background = white);
+		// A playpen of width by height pixels. All playpens share one
+		// window, so this throws if playpens of another size exist.
+		// (The one argument version accepts whatever size is in use.)
+		playpen(int width, int height, hue background = white);
 		~playpen();
 
 		// Playpens are copyable because all instances share the same 
@@ -173,6 +211,32 @@ namespace studentgraphics {
 		// the rounding is to avoid problems of conversion from int to double and back again
 		// introducing a rounding error
 		playpen&		plot(double x, double y, hue h){return plot(int(x+0.5), int(y+0.5), h);}
+
+		// Bulk plotting. Each has the same effect as the equivalent
+		// sequence of plot() calls but is much faster because clipping,
+		// origin and scale are dealt with once rather than per pixel.
+		// A pixel position as used by plot_points().
+		struct point {
+			int x, y;
+		};
+		// Plot length pixels from (x, y) going right.
+		playpen&		plot_span(int x, int y, int length, hue h);
+		// Plot width by height pixels with (x, y) at the bottom left.
+		playpen&		fill_rect(int x, int y, int width, int height, hue h);
+		// Plot the n pixels in pts.
+		playpen&		plot_points(point const * pts, int n, hue h);
+		// Plot the line from (x0, y0) towards (x1, y1) as drawline does,
+		// leaving out the end point. Only the part that is on the canvas
+		// costs anything.
+		playpen&		plot_line(int x0, int y0, int x1, int y1, hue h);
+		// Recolour every pixel, or every pixel of the width by height
+		// rectangle with (x, y) at the bottom left: those of hue from
+		// become to, or each pixel p becomes table[p]. Unlike replace_hue
+		// the pixels need not be connected. The plotting mode is ignored.
+		playpen&		replace_all(hue from, hue to);
+		playpen&		replace_all(hue from, hue to, int x, int y, int width, int height);
+		playpen&		remap(unsigned char const table[256]);
+		playpen&		remap(unsigned char const table[256], int x, int y, int width, int height);
    	    hue	    	    get_hue(int x, int y)const;
 	      
 		// Set the plotting mode for subsequent calls to plot().
@@ -181,6 +245,9 @@ namespace studentgraphics {
 		origin_data	   	origin()const {return origin_data(xorg, yorg);}
 		bool			scale(int i){return pixsize.size(i);}
 		int				scale()const {return pixsize.size();}
+		// Size in raw pixels.
+		int				width()const;
+		int				height()const;
 		raw_pixel_data get_raw_xy(int i, int j){return raw_pixel_data(xorg+ i * pixsize.size(),
 																yorg - j * pixsize.size());}			
 		
@@ -217,7 +284,10 @@ namespace studentgraphics {
 		ostream & save(ostream &)const;	 	 
 		
 		// Restore all state from binary file. Automatically updates physical
-		// display to reflect changed state.
+		// display to reflect changed state. Saves record the canvas size,
+		// and restoring one made at another size sets failbit and changes
+		// nothing. Files saved before sizes were recorded restore only on
+		// a canvas of the default Xpixels by Ypixels.
 		istream & restore(istream &);	
 
 		// Not currently implemented.
@@ -228,6 +298,65 @@ namespace studentgraphics {
 		// scaling.
 		hue getrawpixel(int x, int y) const;
 		void setrawpixel(int x, int y, hue h);
+		// Copy a width by height block of raw pixels to (x, y), also
+		// ignoring plotmode, origin and scaling. Row r of the block starts
+		// at src + r*stride. Parts that miss the playpen are ignored.
+		void setrawpixels(int x, int y, int width, int height,
+						  hue const * src, int stride);
+		// The width() raw pixels of row y, left to right, to read without
+		// copying them. The pointer stays valid while any playpen exists
+		// and sees whatever is drawn later.
+		hue const * getrawrow(int y) const;
+		// Flood fills, also on raw pixels: change every pixel 4-connected
+		// to (x, y) through pixels that are neither boundary nor h, or
+		// through pixels of the hue (x, y) has, to h. Nothing happens if
+		// (x, y) is off the canvas or cannot itself be filled. These are
+		// what seed_fill and replace_hue use.
+		void fillrawregion(int x, int y, hue h, hue boundary);
+		void replacerawregion(int x, int y, hue h);
+		// A set of connected pixels of one hue, in raw pixels with all
+		// edges of the bounding box included.
+		struct region {
+			hue shade;
+			unsigned long size;
+			int left, top, right, bottom;
+		};
+		// Find every region of connected pixels of the same hue, through
+		// pixels sharing an edge or, if eight_connected, also a corner.
+		// labels is resized to width() * height() and raw pixel (x, y) is
+		// given the index in regions of its region at labels[y * width() +
+		// x]. Regions are numbered in the order their first pixels come,
+		// going along each row from the top. Returns the number of them.
+		unsigned labelrawregions(std::vector<unsigned> & labels,
+								 std::vector<region> & regions,
+								 bool eight_connected = false) const;
+
+		// Performance counters, totals since the program started or the
+		// last reset_stats(). They are only gathered when the library is
+		// compiled with PLAYPEN_STATS defined (for instance
+		// make -f makefile.txt C_PREPROC=-DPLAYPEN_STATS); otherwise
+		// every field stays 0 and the counting costs nothing. With the
+		// asynchronous display the requests and bytes of a frame are added
+		// by the display() after it, so they may be a frame behind, and
+		// display_seconds covers only copying the frame for the window's
+		// thread, not its upload.
+		struct statistics {
+			unsigned long pixels_plotted;
+			unsigned long pixels_clipped;	// off the canvas, so ignored
+			unsigned long display_calls;
+			unsigned long requests;			// X requests or GDI calls
+			unsigned long bytes_uploaded;	// to the X server or GDI
+			double display_seconds;
+			double palette_seconds;
+			double png_encode_seconds;
+			double png_decode_seconds;
+		};
+		static statistics stats();
+		static void reset_stats();
+		// Write stats() to cerr at most every seconds, checked on each
+		// display(); 0 or less stops it. Setting PLAYPEN_STATS_DUMP to a
+		// number of seconds does the same.
+		static void dump_stats_every(double seconds);
 
 	private:
 		plotmode pmode;
@@ -250,15 +379,61 @@ namespace studentgraphics {
 	//	Basic.
 	void LoadPlaypen(playpen& p, std::string filename);
 
+	// How hard SavePlaypen works at making the file small: png_fast is 
+	// quickest, png_small gives the smallest files but takes longest.
+	enum png_compression {png_fast, png_default, png_small};
+
 	// Purpose:
 	//	Save a playpen image in PNG format.
 	// Parameters:
 	//	[in] p -	The playpen from which the image will be read.
 	//	[in, out] stm - The stream to which the image will be saved. The
 	//					stream must be opened in binary mode.
+	//	[in] compression -	The trade of time against file size.
+	//	[in] threads -	How many threads may share the compression of a 
+	//					large canvas: 1 keeps it on the calling thread 
+	//					and 0 means one per processor.
 	// Exception Safety:
 	//	Basic.
-	void SavePlaypen(playpen const & p, std::string filename);
+	void SavePlaypen(playpen const & p, std::string filename, 
+		png_compression compression = png_default, int threads = 1);
+
+	// Called when a background save has finished: failure is empty if
+	// the file was written, otherwise it says what went wrong.
+	typedef void (*save_done)(std::string const & filename, 
+		std::string const & failure, void * context);
+
+	// Purpose:
+	//	Save a playpen image in PNG format without waiting for it. The
+	//	canvas and palette are copied and the copy is written by a thread
+	//	of its own, one save after another in the order asked for.
+	// Parameters:
+	//	[in] p -	The playpen from which the image will be read.
+	//	[in] filename -	The file to write.
+	//	[in] done -	If not null, called with filename, the outcome and
+	//				context once the file is closed. It is called on the 
+	//				saving thread, so must not throw and must do its own 
+	//				locking of anything the program's thread also uses.
+	//	[in] compression -	As for SavePlaypen.
+	// Notes:
+	// 1. Once SaveQueueDepth() saves are waiting to start, another blocks
+	//	until the oldest has started, so a program that asks for saves
+	//	faster than they can be written is held to their pace rather than
+	//	piling up copies of the canvas.
+	// 2. Call WaitForSaves before the program ends, or saves still queued
+	//	may be lost.
+	// Exception Safety:
+	//	Strong: if copying the canvas fails nothing is queued.
+	void SavePlaypenAsync(playpen const & p, std::string filename, 
+		save_done done = 0, void * context = 0, 
+		png_compression compression = png_default);
+
+	// Returns when every save SavePlaypenAsync has queued has finished.
+	void WaitForSaves();
+
+	// How many saves may wait to start, at least 1; 2 by default.
+	void SetSaveQueueDepth(int n);
+	int SaveQueueDepth();
 	
 }// namespace studentgraphics
 
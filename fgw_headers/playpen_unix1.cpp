@@ -8,33 +8,48 @@
 // However, this would complicate the build steps and considering the code
 // is intended to be used (if not understood) by novices, this has not been
 // done.
+//
+// The window contents are transferred with XPutImage, using the MIT-SHM
+// extension when the display supports it, so programs using this file
+// must be linked with -lX11 -lXext -lpthread.
 
 // Implemented interface
 
 #include "keyboard.h"
 #include "mouse.h"
 #include "playpen.h"
+#include "plot_kernels.h"
+#include "stats_counters.h"
 
 // C++ standard headers
 
+#include <algorithm>
 #include <assert.h>
+#include <deque>
+#include <math.h>
 #include <map>
 #include <stdexcept>
 #include <stdlib.h>
 #include <streambuf>
+#include <string.h>
+#include <vector>
 
 // Posix headers
 
 #include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 // X Window headers
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 #include <X11/keysym.h>
 
    namespace
@@ -97,27 +112,172 @@
       }
    
     // **********************************************************************
-    // The content of the graphic window
+    // A rectangle of pixels, right and bottom excluded
+    
+       struct PixelRect
+      {
+         int left;
+         int top;
+         int right;
+         int bottom;
+      };
+   
+    // **********************************************************************
+    // The content of the graphic window.  Every row starts on a RowAlign
+    // boundary, stride bytes after the previous one.  Changes are recorded
+    // per 32x32 tile so that Display only has to transfer what has been
+    // touched since the previous call.
     
-       struct Pixels
+       struct Pixels: private CopyDisabler
       {
-         hue p[Ypixels][Xpixels];
+         enum {
+            TileShift   = 5,
+            TileSize    = 1 << TileShift,
+            RowAlign    = 32
+         };
         
-         explicit Pixels(hue fillHue);
+         int const   width;
+         int const   height;
+         int const   stride;
+         int const   tilesAcross;
+         int const   tilesDown;
+         std::vector<unsigned char> dirty;    // tilesDown rows of tilesAcross
+         bool        anyDirty;
+        
+         Pixels(int w, int h, hue fillHue);
+         ~Pixels();
+        
+         hue*       Row(int y)       { return data_ + y * stride; }
+         hue const* Row(int y) const { return data_ + y * stride; }
       
          void Clear(hue fillHue);
+        
+         void MarkDirty(int x, int y);
+         void MarkDirty(int left, int top, int right, int bottom);
+         void MarkAllDirty();
+         void ClearDirty();
+        
+        // Merge the dirty tiles into as few rectangles as the tile rows
+        // allow: horizontal runs of tiles, extended downwards while the
+        // next tile row has the same run.
+         void GetDirtyRects(std::vector<PixelRect>& rects) const;
+      
+      private:
+         void* block_;       // as allocated, data_ is aligned within it
+         hue*  data_;
       };
    
-       inline
-       Pixels::Pixels(hue fillHue)
+       Pixels::Pixels(int w, int h, hue fillHue)
+        : width(w),
+          height(h),
+          stride((w + RowAlign - 1) / RowAlign * RowAlign),
+          tilesAcross((w + TileSize - 1) / TileSize),
+          tilesDown((h + TileSize - 1) / TileSize),
+          dirty(tilesAcross * tilesDown),
+          block_(malloc(stride * h + RowAlign - 1))
       {
+         if (block_ == 0) {
+            throw std::bad_alloc();
+         }
+         size_t const misalign =
+            reinterpret_cast<size_t>(block_) & (RowAlign - 1);
+         data_ = static_cast<hue*>(block_)
+                 + (misalign ? RowAlign - misalign : 0);
          Clear(fillHue);
       }
+   
+       Pixels::~Pixels()
+      {
+         free(block_);
+      }
     
-       inline
        void Pixels::Clear(hue fillHue)
       {
-         memset(p[0], fillHue, Ypixels*Xpixels);
+         memset(data_, fillHue, stride * height);
+         MarkAllDirty();
+      }
+   
+       inline
+       void Pixels::MarkDirty(int x, int y)
+      {
+         dirty[(y >> TileShift) * tilesAcross + (x >> TileShift)] = true;
+         anyDirty = true;
+      }
+   
+    // left, top, right and bottom are all included and must be on the
+    // canvas.
+       void Pixels::MarkDirty(int left, int top, int right, int bottom)
+      {
+         for (int ty = top >> TileShift; ty <= bottom >> TileShift; ++ty) {
+            for (int tx = left >> TileShift; tx <= right >> TileShift; ++tx) {
+               dirty[ty * tilesAcross + tx] = true;
+            }
+         }
+         anyDirty = true;
+      }
+   
+       void Pixels::MarkAllDirty()
+      {
+         std::fill(dirty.begin(), dirty.end(), true);
+         anyDirty = true;
+      }
+   
+       void Pixels::ClearDirty()
+      {
+         std::fill(dirty.begin(), dirty.end(), false);
+         anyDirty = false;
+      }
+   
+       void Pixels::GetDirtyRects(std::vector<PixelRect>& rects) const
+      {
+         rects.clear();
+         if (!anyDirty) {
+            return;
+         }
+         std::vector<PixelRect>::size_type open = 0; // rects of previous row
+         for (int ty = 0; ty < tilesDown; ++ty) {
+            std::vector<PixelRect>::size_type rowStart = rects.size();
+            int const top = ty * TileSize;
+            int tx = 0;
+            while (tx < tilesAcross) {
+               if (!dirty[ty * tilesAcross + tx]) {
+                  ++tx;
+                  continue;
+               }
+               PixelRect r;
+               r.left = tx * TileSize;
+               while (tx < tilesAcross && dirty[ty * tilesAcross + tx]) {
+                  ++tx;
+               }
+               r.right = std::min(tx * TileSize, width);
+               r.top = top;
+               r.bottom = std::min(top + TileSize, height);
+               
+               // extend a rectangle of the row above with the same run
+               bool merged = false;
+               for (std::vector<PixelRect>::size_type i = open;
+                    i != rowStart; ++i) {
+                  if (rects[i].left == r.left && rects[i].right == r.right
+                      && rects[i].bottom == top) {
+                     rects[i].bottom = r.bottom;
+                     merged = true;
+                     break;
+                  }
+               }
+               if (!merged) {
+                  rects.push_back(r);
+               }
+            }
+            // rectangles extended in this row stay open for the next one
+            std::vector<PixelRect>::size_type firstOpen = rects.size();
+            for (std::vector<PixelRect>::size_type i = open;
+                 i != rects.size(); ++i) {
+               if (rects[i].bottom == std::min(top + TileSize, height)) {
+                  firstOpen = std::min(firstOpen, i);
+               }
+            }
+            open = firstOpen;
+         }
       }
    
    
@@ -138,6 +298,7 @@
          void Leave();
       
       private:
+         friend class Condition;
          pthread_mutex_t cs_;
       };
    
@@ -191,6 +352,47 @@
          cs_.Leave();
       }
     
+    // **********************************************************************
+    // Wrapper around a condition variable. Wait must be called with the
+    // CriticalSection entered, and returns with it entered again; as a
+    // wake up may be spurious, callers wait in a loop testing what they
+    // are waiting for.
+    
+       class Condition: private CopyDisabler
+      {
+      public:
+         Condition();
+         ~Condition();
+      
+         void Wait(CriticalSection& cs);
+         void Broadcast();
+      
+      private:
+         pthread_cond_t cond_;
+      };
+   
+       Condition::Condition()
+      {
+         pthread_cond_init(&cond_, 0);
+      }
+   
+       Condition::~Condition()
+      {
+         pthread_cond_destroy(&cond_);
+      }
+   
+       inline
+       void Condition::Wait(CriticalSection& cs)
+      {
+         pthread_cond_wait(&cond_, &cs.cs_);
+      }
+   
+       inline
+       void Condition::Broadcast()
+      {
+         pthread_cond_broadcast(&cond_);
+      }
+    
     // **********************************************************************
     // Wrapper around thread
    
@@ -215,6 +417,7 @@
    
        inline
        Thread::Thread()
+        : running_(false)
       {
       }
         
@@ -238,6 +441,76 @@
          }
       }
    
+    // **********************************************************************
+    // One call of a job on a thread of its own, for RunConcurrently and
+    // RunInBackground.
+   
+       struct ConcurrentCall
+      {
+         void (*job)(void*);
+         void* context;
+      };
+   
+    extern "C" {
+      static void* ConcurrentCallForwarder(void*);
+    }
+   
+    extern "C" 
+       void* ConcurrentCallForwarder(void* arg)
+      {
+         ConcurrentCall* call = static_cast<ConcurrentCall*>(arg);
+         call->job(call->context);
+         return 0;
+      }
+   
+    // **********************************************************************
+    // The jobs of RunInBackground and the thread that calls them, one at
+    // a time in order. Created with the first job and never destroyed, so
+    // that a job still running as the program ends never finds it gone.
+    // changed is broadcast whenever jobs or busy change.
+   
+       struct BackgroundQueue
+      {
+         BackgroundQueue() : busy(false) {}
+      
+         CriticalSection lock;
+         Condition changed;
+         std::deque<ConcurrentCall> jobs;
+         bool busy;                         // a job has been taken
+         Thread thread;
+      };
+   
+      BackgroundQueue* backgroundQueue = 0;
+   
+    extern "C" {
+      static void* BackgroundForwarder(void*);
+    }
+   
+    extern "C" 
+       void* BackgroundForwarder(void* arg)
+      {
+         BackgroundQueue& queue = *static_cast<BackgroundQueue*>(arg);
+         for (;;) {
+            ConcurrentCall call;
+            {
+               CSLocker lock(queue.lock);
+               if (queue.jobs.empty()) {
+                  queue.busy = false;
+                  queue.changed.Broadcast();
+                  while (queue.jobs.empty()) {
+                     queue.changed.Wait(queue.lock);
+                  }
+               }
+               call = queue.jobs.front();
+               queue.jobs.pop_front();
+               queue.busy = true;
+               queue.changed.Broadcast();
+            }
+            call.job(call.context);
+         }
+         return 0;
+      }
+   
     // ======================================================================
     // Main platform-specific class
     // ======================================================================
@@ -256,9 +529,18 @@
     // sharedStateLock_ then xLock_ to prevent dead lock.
     //
     // The two threads communicate throw the shared members and throw a
-    // pipe.  Currently the only message which pass in the pipe is a
-    // notification for the worker thread to terminate when the pipe is
-    // closed.
+    // pipe.  Closing the pipe tells the worker thread to terminate.
+    //
+    // With IsAsyncDisplay() Display only copies the changed tiles into
+    // frame_ and writes a byte to the pipe; the worker thread converts
+    // and uploads frame_ when it wakes up.  A frame arriving before the
+    // previous one has been shown is merged into it, so only the latest
+    // pixels are ever uploaded.  frameLock_ protects frame_ and
+    // framePending_ and is taken before xLock_.
+    //
+    // When IsHeadless() there is no X connection and no worker thread at
+    // all: Display and UpdatePalette do nothing and there is never any
+    // mouse or keyboard input.
    
     extern "C" {
       static void* WorkerThreadForwarder(void*);
@@ -284,6 +566,8 @@
         
          void         InitializeX();
          void         InitializeKeySymMap();
+         void         InitializeImage();
+         void         FinalizeImage();
          void         FinalizeX();
         
       
@@ -293,9 +577,21 @@
          void         HandleKeyPress(XEvent& event);
          void         InitializePalette(HueRGB256 const&);
          void         FinalizePalette();
+         void         ConvertPixels(Pixels const& pixels, PixelRect const& r);
+         void         PutImage(PixelRect const& r);
+         void         FinishPutImage();
+         void         CountUpload(std::vector<PixelRect> const& rects,
+                                  unsigned long& requests,
+                                  unsigned long& bytes) const;
+         void         PresentFrame();
+        
+         static int   ShmErrorHandler(::Display*, XErrorEvent*);
         
         // used read only when both threads exist
          static SingletonWindowImpl* instance_;
+         bool                    headless_;
+         int                     width_;
+         int                     height_;
          Thread                  thread_;
          int                     pipeout_;
          int                     pipein_;
@@ -309,6 +605,14 @@
          unsigned long           palette_[colours];
          std::map<KeySym, int>   keySymToKey_;
       
+        // protected by frameLock_, frame_ is only allocated when async_
+         CriticalSection         frameLock_;
+         bool                    async_;
+         Pixels*                 frame_;
+         bool                    framePending_;
+         unsigned long           frameRequests_; // uploaded, not yet counted
+         unsigned long           frameBytes_;
+      
         // protected by xLock_
          mutable CriticalSection xLock_;
          ::Display*              display_;
@@ -318,7 +622,13 @@
          GC                      gc_;
          Window                  window_;
          XComposeStatus          compose_;
+         XImage*                 image_;
+         XShmSegmentInfo         shmInfo_;
+         bool                    useShm_;
+         std::vector<PixelRect>  dirtyRects_;
+         std::vector<PixelRect>  frameRects_;    // frameLock_, main thread
         
+         static bool             shmFailed_;
       };
    
     extern "C" 
@@ -328,15 +638,35 @@
       }
    
       SingletonWindowImpl* SingletonWindowImpl::instance_;
+      bool SingletonWindowImpl::shmFailed_;
     
        SingletonWindowImpl::SingletonWindowImpl
         (Pixels const& pixels, HueRGB256 const& palette)
+        : headless_(IsHeadless()),
+          width_(pixels.width),
+          height_(pixels.height),
+          mouseButtonDown_(false),
+          key_(0),
+          quit_(false),
+          async_(false),
+          frame_(0),
+          framePending_(false),
+          frameRequests_(0),
+          frameBytes_(0)
       {
          mouseLocation_.x(-1);
          mouseLocation_.y(-1);
+         if (headless_) {
+            return;
+         }
+         if (IsAsyncDisplay()) {
+            frame_ = new Pixels(width_, height_, hue(0));
+            async_ = true;
+         }
       
          InitializeKeySymMap();
          InitializeX();
+         InitializeImage();
          InitializePalette(palette);
       
          int thePipes[2];
@@ -351,13 +681,18 @@
    
        SingletonWindowImpl::~SingletonWindowImpl()
       {
+         if (headless_) {
+            return;
+         }
          sharedStateLock_.Enter();
          quit_ = true;
          close(pipeout_);
          sharedStateLock_.Leave();
          thread_.Join();
+         delete frame_;
       
          FinalizePalette();
+         FinalizeImage();
          FinalizeX();
       }
    
@@ -505,7 +840,7 @@
                     (display_,
                      DefaultRootWindow(display_),
                      50, 100,
-                     Xpixels, Ypixels,
+                     width_, height_,
                      10,
                      WhitePixel(display_, screen_),
                      BlackPixel(display_, screen_));
@@ -514,7 +849,7 @@
         
          pixmap_ = XCreatePixmap
                      (display_, window_,
-                      Xpixels, Ypixels,
+                      width_, height_,
                       DefaultDepth(display_, screen_));
          XGCValues GCValues;
          gc_ = XCreateGC(display_, window_, 0, &GCValues);
@@ -546,54 +881,274 @@
          XFreeColors(display_, colormap_, palette_, colours, 0);
       }
     
-       void SingletonWindowImpl::FinalizeX()
+    // XShmAttach fails asynchronously (typically because the X server is
+    // on another machine), so the failure is caught with a temporary
+    // error handler and we fall back to a plain XImage.
+       int SingletonWindowImpl::ShmErrorHandler(::Display*, XErrorEvent*)
       {
-         XCloseDisplay(display_);
+         shmFailed_ = true;
+         return 0;
       }
    
-       void SingletonWindowImpl::Display(Pixels const& pixels)
+       void SingletonWindowImpl::InitializeImage()
       {
-         XGCValues newValues;
-         CSLocker locker(xLock_);
+         Visual* visual = DefaultVisual(display_, screen_);
+         int     depth = DefaultDepth(display_, screen_);
       
-         newValues.foreground = palette_[pixels.p[0][0]];
-         XChangeGC (display_, gc_, GCForeground, &newValues);
+         image_ = 0;
+         useShm_ = false;
+         if (XShmQueryExtension(display_)) {
+            image_ = XShmCreateImage(display_, visual, depth, ZPixmap, 0,
+                                     &shmInfo_, width_, height_);
+         }
+         if (image_ != 0) {
+            shmInfo_.shmid = shmget(IPC_PRIVATE,
+                                    image_->bytes_per_line * image_->height,
+                                    IPC_CREAT | 0600);
+            shmInfo_.shmaddr = (char*)-1;
+            if (shmInfo_.shmid >= 0) {
+               shmInfo_.shmaddr = (char*)shmat(shmInfo_.shmid, 0, 0);
+            }
+            if (shmInfo_.shmaddr != (char*)-1) {
+               image_->data = shmInfo_.shmaddr;
+               shmInfo_.readOnly = False;
+               shmFailed_ = false;
+               XSync(display_, False);
+               int (*oldHandler)(::Display*, XErrorEvent*) =
+                  XSetErrorHandler(ShmErrorHandler);
+               XShmAttach(display_, &shmInfo_);
+               XSync(display_, False);
+               XSetErrorHandler(oldHandler);
+               useShm_ = !shmFailed_;
+               if (!useShm_) {
+                  shmdt(shmInfo_.shmaddr);
+               }
+            }
+            if (shmInfo_.shmid >= 0) {
+               // the segment goes away once both sides have detached
+               shmctl(shmInfo_.shmid, IPC_RMID, 0);
+            }
+            if (!useShm_) {
+               image_->data = 0;
+               XDestroyImage(image_);
+               image_ = 0;
+            }
+         }
         
-         for (int x = 0; x < Xpixels; ++x) {
-            int starty = 0;
-            if (newValues.foreground != palette_[pixels.p[0][x]]) {
-               newValues.foreground = palette_[pixels.p[0][x]];
-               XChangeGC (display_, gc_, GCForeground, &newValues);
+         if (image_ == 0) {
+            image_ = XCreateImage(display_, visual, depth, ZPixmap, 0, 0,
+                                  width_, height_, 32, 0);
+            if (image_ == 0) {
+               throw playpen::exception
+                   (playpen::exception::error, "Unable to create image");
+            }
+            image_->data =
+               static_cast<char*>(malloc(image_->bytes_per_line * height_));
+            if (image_->data == 0) {
+               XDestroyImage(image_);
+               throw std::bad_alloc();
             }
-            for (int y = 1; y < Ypixels; ++y) {
-               if (newValues.foreground != palette_[pixels.p[y][x]]) {
-                  if (y == starty + 1) {
-                     XDrawPoint(display_, pixmap_, gc_, x, starty);
-                  } 
-                  else {
-                     XDrawLine(display_, pixmap_, gc_, x, starty, x, y-1);
+         }
+      }
+   
+       void SingletonWindowImpl::FinalizeImage()
+      {
+         if (useShm_) {
+            XShmDetach(display_, &shmInfo_);
+            XSync(display_, False);
+            image_->data = 0;
+            XDestroyImage(image_);
+            shmdt(shmInfo_.shmaddr);
+         } 
+         else {
+            XDestroyImage(image_);      // also frees the malloc'ed data
+         }
+      }
+    
+       void SingletonWindowImpl::FinalizeX()
+      {
+         XCloseDisplay(display_);
+      }
+   
+    // Translate the hues into the pixel values of the visual. The common
+    // depths are written directly into the image memory, anything else
+    // (or an image in the other byte order) goes through XPutPixel.
+       void SingletonWindowImpl::ConvertPixels
+        (Pixels const& pixels, PixelRect const& r)
+      {
+         int const  one = 1;
+         int const  hostOrder =
+            *reinterpret_cast<char const*>(&one) ? LSBFirst : MSBFirst;
+         int const  bpp =
+            image_->byte_order == hostOrder ? image_->bits_per_pixel : 0;
+        
+         for (int y = r.top; y < r.bottom; ++y) {
+            hue const* src = pixels.Row(y);
+            char*      row = image_->data + y * image_->bytes_per_line;
+            switch (bpp) {
+               case 32:
+                  {
+                     unsigned int* dst = reinterpret_cast<unsigned int*>(row);
+                     for (int x = r.left; x < r.right; ++x) {
+                        dst[x] = palette_[src[x]];
+                     }
+                  }
+                  break;
+               case 16:
+                  {
+                     unsigned short* dst =
+                        reinterpret_cast<unsigned short*>(row);
+                     for (int x = r.left; x < r.right; ++x) {
+                        dst[x] = palette_[src[x]];
+                     }
+                  }
+                  break;
+               case 8:
+                  for (int x = r.left; x < r.right; ++x) {
+                     row[x] = palette_[src[x]];
                   }
-                  newValues.foreground = palette_[pixels.p[y][x]];
-                  starty = y;
-                  XChangeGC (display_, gc_, GCForeground, &newValues);
+                  break;
+               default:
+                  for (int x = r.left; x < r.right; ++x) {
+                     XPutPixel(image_, x, y, palette_[src[x]]);
+                  }
+                  break;
+            }
+         }
+      }
+   
+    // Requires xLock_ held.
+       void SingletonWindowImpl::PutImage(PixelRect const& r)
+      {
+         int const width = r.right - r.left;
+         int const height = r.bottom - r.top;
+         if (useShm_) {
+            XShmPutImage(display_, pixmap_, gc_, image_,
+                         r.left, r.top, r.left, r.top, width, height, False);
+         } 
+         else {
+            XPutImage(display_, pixmap_, gc_, image_,
+                      r.left, r.top, r.left, r.top, width, height);
+         }
+         XCopyArea(display_, pixmap_, window_, gc_,
+                   r.left, r.top, width, height, r.left, r.top);
+      }
+   
+    // Only the tiles marked in pixels are transferred; when nothing has
+    // changed no X request is made at all.
+       void SingletonWindowImpl::Display(Pixels const& pixels)
+      {
+         if (headless_ || !pixels.anyDirty) {
+            return;
+         }
+         if (async_) {
+            CSLocker locker(frameLock_);
+            // the worker's uploads are counted here, on the program's
+            // thread, so that stats() never races with it
+            PLAYPEN_COUNT(requests, frameRequests_);
+            PLAYPEN_COUNT(bytes_uploaded, frameBytes_);
+            frameRequests_ = 0;
+            frameBytes_ = 0;
+            pixels.GetDirtyRects(frameRects_);
+            for (std::vector<PixelRect>::size_type i = 0;
+                 i != frameRects_.size(); ++i) {
+               PixelRect const& r = frameRects_[i];
+               for (int y = r.top; y != r.bottom; ++y) {
+                  memcpy(frame_->Row(y) + r.left, pixels.Row(y) + r.left,
+                         r.right - r.left);
                }
+               frame_->MarkDirty(r.left, r.top, r.right - 1, r.bottom - 1);
             }
-            if (Ypixels == starty + 1) {
-               XDrawPoint(display_, pixmap_, gc_, x, starty);
-            } 
-            else {
-               XDrawLine(display_, pixmap_, gc_, x, starty, x, Ypixels-1);
+            if (!framePending_) {
+               // one byte wakes the worker however many frames follow
+               framePending_ = true;
+               char const wake = 'f';
+               write(pipeout_, &wake, 1);
             }
+            return;
          }
-        
-         XCopyArea
-            (display_, pixmap_, window_, gc_, 0, 0, Xpixels, Ypixels, 0, 0);
-         XFlush(display_);
+         CSLocker locker(xLock_);
+         pixels.GetDirtyRects(dirtyRects_);
+         for (std::vector<PixelRect>::size_type i = 0;
+              i != dirtyRects_.size(); ++i) {
+            ConvertPixels(pixels, dirtyRects_[i]);
+            PutImage(dirtyRects_[i]);
+         }
+         FinishPutImage();
+         unsigned long requests = 0;
+         unsigned long bytes = 0;
+         CountUpload(dirtyRects_, requests, bytes);
+         PLAYPEN_COUNT(requests, requests);
+         PLAYPEN_COUNT(bytes_uploaded, bytes);
+      }
+   
+    // Requires xLock_ held.
+       void SingletonWindowImpl::FinishPutImage()
+      {
+         if (useShm_) {
+            // the server reads the shared segment asynchronously; it must
+            // be done before the next conversion overwrites it.
+            XSync(display_, False);
+         } 
+         else {
+            XFlush(display_);
+         }
+      }
+   
+    // Requires xLock_ held.  Adds the X requests and bytes that PutImage
+    // and FinishPutImage send for rects; only done with PLAYPEN_STATS.
+       void SingletonWindowImpl::CountUpload(std::vector<PixelRect> const& rects,
+                                             unsigned long& requests,
+                                             unsigned long& bytes) const
+      {
+      #if defined(PLAYPEN_STATS)
+         requests += 2 * rects.size() + (useShm_ ? 1 : 0);
+         for (std::vector<PixelRect>::size_type i = 0; i != rects.size(); ++i) {
+            PixelRect const& r = rects[i];
+            bytes += (unsigned long)(r.right - r.left) * (r.bottom - r.top)
+                     * image_->bits_per_pixel / 8;
+         }
+      #else
+         (void)rects;
+         (void)requests;
+         (void)bytes;
+      #endif
+      }
+   
+    // Worker thread only.  frameLock_ is released as soon as frame_ has
+    // been converted so that the main thread can start on the next frame
+    // while this one goes to the server.
+       void SingletonWindowImpl::PresentFrame()
+      {
+         frameLock_.Enter();
+         if (!framePending_) {
+            frameLock_.Leave();
+            return;
+         }
+         xLock_.Enter();
+         frame_->GetDirtyRects(dirtyRects_);
+         for (std::vector<PixelRect>::size_type i = 0;
+              i != dirtyRects_.size(); ++i) {
+            ConvertPixels(*frame_, dirtyRects_[i]);
+         }
+         frame_->ClearDirty();
+         framePending_ = false;
+         CountUpload(dirtyRects_, frameRequests_, frameBytes_);
+         frameLock_.Leave();
+         for (std::vector<PixelRect>::size_type i = 0;
+              i != dirtyRects_.size(); ++i) {
+            PutImage(dirtyRects_[i]);
+         }
+         FinishPutImage();
+         xLock_.Leave();
       }
    
        void SingletonWindowImpl::UpdatePalette
         (Pixels const & pixels, HueRGB256 const & palette)
       {
+         if (headless_) {
+            return;
+         }
          {
             CSLocker locker(xLock_);
             FinalizePalette();
@@ -666,7 +1221,7 @@
                         CSLocker lock(xLock_);
                         XCopyArea
                             (display_, pixmap_, window_, gc_,
-                             0, 0, Xpixels, Ypixels, 0, 0);
+                             0, 0, width_, height_, 0, 0);
                         XFlush(display_);
                      }
                      break;
@@ -714,6 +1269,14 @@
                                           &readDescriptors, 0, 0, 0);
             } while (descriptorsReady == 0);
             
+            if (descriptorsReady > 0 && FD_ISSET(pipein_, &readDescriptors)) {
+               // a frame to show, or end of file when the pipe is closed
+               char wake[16];
+               if (read(pipein_, wake, sizeof(wake)) > 0) {
+                  PresentFrame();
+               }
+            }
+            
             {
                CSLocker lock(sharedStateLock_);
                quit = quit_;
@@ -1047,12 +1610,145 @@
       select(0, 0, 0, 0, &timeOut);
    }
 
+    double studentgraphics::MonotonicTime()
+   {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      return now.tv_sec + now.tv_nsec * 1e-9;
+   }
+
+// ======================================================================
+// Platform-specific support for the parallel flood fill
+// ======================================================================
+
+    int studentgraphics::detail::ProcessorCount()
+   {
+      long const n = sysconf(_SC_NPROCESSORS_ONLN);
+      return n > 0 ? int(n) : 1;
+   }
+
+// The calling thread does the first job, so n - 1 threads are started.
+    void studentgraphics::detail::RunConcurrently(void (*job)(void*),
+                                                  void* const* contexts, int n)
+   {
+      std::vector<ConcurrentCall> calls(n);
+      Thread* threads = new Thread[n];
+      for (int i = 1; i < n; ++i) {
+         calls[i].job = job;
+         calls[i].context = contexts[i];
+         threads[i].Run(ConcurrentCallForwarder, &calls[i]);
+      }
+      job(contexts[0]);
+      for (int i = 1; i < n; ++i) {
+         threads[i].Join();
+      }
+      delete [] threads;
+   }
+
+// ======================================================================
+// Platform-specific support for background saving
+// ======================================================================
+
+    void studentgraphics::detail::RunInBackground(void (*job)(void*),
+                                                  void* context, int queueLimit)
+   {
+      if (!backgroundQueue) {
+         backgroundQueue = new BackgroundQueue;
+         backgroundQueue->thread.Run(BackgroundForwarder, backgroundQueue);
+      }
+      BackgroundQueue& queue = *backgroundQueue;
+      CSLocker lock(queue.lock);
+      while (int(queue.jobs.size()) >= queueLimit) {
+         queue.changed.Wait(queue.lock);
+      }
+      ConcurrentCall call;
+      call.job = job;
+      call.context = context;
+      queue.jobs.push_back(call);
+      queue.changed.Broadcast();
+   }
+
+    void studentgraphics::detail::WaitForBackground()
+   {
+      if (!backgroundQueue) {
+         return;
+      }
+      BackgroundQueue& queue = *backgroundQueue;
+      CSLocker lock(queue.lock);
+      while (!queue.jobs.empty() || queue.busy) {
+         queue.changed.Wait(queue.lock);
+      }
+   }
+
+// A signal can cut nanosleep short, so keep going until the deadline.
+    void studentgraphics::WaitUntil(double deadline)
+   {
+      for (;;) {
+         double const left = deadline - MonotonicTime();
+         if (left <= 0) {
+            return;
+         }
+         struct timespec pause;
+         pause.tv_sec = time_t(left);
+         pause.tv_nsec = long((left - pause.tv_sec) * 1e9);
+         nanosleep(&pause, 0);
+      }
+   }
+
 // ======================================================================
 // Plaform-specific code ends here. From now on it's platform-independent
 // code until the end of the file.
 // ======================================================================
 
    namespace studentgraphics {
+
+    // Window options. -1 until decided, either by the Set function or
+    // from the environment variable the first time anyone asks.
+      namespace {
+         int headlessMode = -1;
+         int asyncDisplayMode = -1;
+         int fillThreads = -1;
+      
+       // Set to anything but empty or 0 counts as on.
+          bool EnvironmentFlag(char const * name) {
+            char const * env = getenv(name);
+            return env != 0 && *env != '\0' && strcmp(env, "0") != 0;
+         }
+      }
+   
+       void SetHeadless(bool on) {
+         headlessMode = on;
+      }
+   
+       bool IsHeadless() {
+         if (headlessMode < 0) {
+            headlessMode = EnvironmentFlag("PLAYPEN_HEADLESS");
+         }
+         return headlessMode != 0;
+      }
+   
+       void SetAsyncDisplay(bool on) {
+         asyncDisplayMode = on;
+      }
+   
+       bool IsAsyncDisplay() {
+         if (asyncDisplayMode < 0) {
+            asyncDisplayMode = EnvironmentFlag("PLAYPEN_ASYNC_DISPLAY");
+         }
+         return asyncDisplayMode != 0;
+      }
+   
+       void SetFillThreads(int n) {
+         fillThreads = n > 0 ? n : detail::ProcessorCount();
+      }
+   
+       int FillThreads() {
+         if (fillThreads < 0) {
+            char const * env = getenv("PLAYPEN_FILL_THREADS");
+            SetFillThreads(env != 0 && *env != '\0' ? atoi(env) : 1);
+         }
+         return fillThreads;
+      }
     
       namespace detail {
         
@@ -1066,17 +1762,44 @@
           class SingletonWindow : private CopyDisabler {
          public:
             // These two control lifetime of singleton using reference count.
-            static SingletonWindow* GetWindow(hue background);
+            // A width or height of 0 accepts whatever size the window
+            // already has (Xpixels by Ypixels for a new one).
+            static SingletonWindow* GetWindow(hue background,
+                                              int width = 0, int height = 0);
             void                    ReleaseWindow();
             
             // Drawing functions.
             void    Plot(int x, int y, hue, plotmode);
-             void    Display() { impl_.Display(pixels_); }
+            // Plot every pixel from (left, top) to (right, bottom), all
+            // edges included. Anything off the canvas is ignored.
+            void    FillRect(int left, int top, int right, int bottom,
+                             hue, plotmode);
+            // Copy a width by height block of pixels whose rows are stride
+            // apart to (left, top), clipped to the canvas.
+            void    CopyIn(int left, int top, int width, int height,
+                           hue const * src, int stride);
+            // Plot the line from (x0, y0) towards (x1, y1), the end point
+            // excluded. Only the part on the canvas is stepped.
+            void    Line(int x0, int y0, int x1, int y1, hue, plotmode);
+            // Change the pixels around (x, y) that pass test to the hue; see
+            // detail::FloodFill. Nothing happens off the canvas.
+            void    FillRegion(int x, int y, FillTest const &, hue);
+            // Recolour the pixels from (left, top) to (right, bottom), edges
+            // included: those of hue from become to, or each pixel p becomes
+            // table[p]. Anything off the canvas is ignored.
+            void    Replace(int left, int top, int right, int bottom,
+                            hue from, hue to);
+            void    Remap(int left, int top, int right, int bottom,
+                          unsigned char const * table);
+            // Label the canvas's regions; see detail::LabelRegions.
+            unsigned Label(bool eightConnected, unsigned * labels,
+                           std::vector<playpen::region> &);
+            void    Display();
             void    Clear();
             void    Clear(hue);
          
             // Palette handling.
-             void    UpdatePalette() { impl_.UpdatePalette(pixels_, hueRGBs_); }
+            void    UpdatePalette();
             void    SetPaletteEntry(hue, HueRGB const &);
             HueRGB  GetPaletteEntry(hue);
          
@@ -1086,6 +1809,10 @@
             
             // GSL: Added for MiniPNG support.
             hue GetPixel(int x, int y) const;
+            hue const * GetRow(int y) const;
+            
+            int Width() const { return pixels_.width; }
+            int Height() const { return pixels_.height; }
          
             // GSL: Added for mouse support.
              mouse::location GetMouseLocation() const 
@@ -1103,7 +1830,11 @@
          private:
             // Public interface to construction/destruction is GetWindow/
             // ReleaseWindow.
-            SingletonWindow(hue);
+            SingletonWindow(hue, int width, int height);
+         
+            // Clip a rectangle to the canvas; false if nothing is left.
+            bool    ClipToCanvas(int & left, int & top, int & right,
+                                 int & bottom) const;
          
             // Construction order of impl_ relative to other members is 
             // important. DO NOT CHANGE.
@@ -1111,6 +1842,10 @@
             HueRGB256           hueRGBs_;
             SingletonWindowImpl impl_;
             hue                 background_;
+            std::vector<FillSpan> fillStack_;
+            std::vector<FillBand> fillBands_;
+            std::vector<LabelRun> labelRuns_;
+            std::vector<unsigned> labelParents_;
          
             static unsigned         refCount_;
             static SingletonWindow* instance_;
@@ -1122,13 +1857,40 @@
           void SingletonWindow::Clear(){ pixels_.Clear(background_);}
           void SingletonWindow::Clear(hue h){ pixels_.Clear(h);}
       
-          SingletonWindow* SingletonWindow::GetWindow(hue background) {
+          void SingletonWindow::Display() {
+            {
+               PLAYPEN_TIME(display_seconds);
+               PLAYPEN_COUNT(display_calls, 1);
+               impl_.Display(pixels_);
+               pixels_.ClearDirty();
+            }
+            PLAYPEN_DUMP_STATS();
+         }
+      
+        // A new palette changes the look of every pixel.
+          void SingletonWindow::UpdatePalette() {
+            PLAYPEN_TIME(palette_seconds);
+            pixels_.MarkAllDirty();
+            impl_.UpdatePalette(pixels_, hueRGBs_);
+            pixels_.ClearDirty();
+         }
+      
+          SingletonWindow* SingletonWindow::GetWindow(hue background,
+                                                      int width, int height) {
             if (0 == refCount_) {
-               instance_ = new SingletonWindow(background);
+               instance_ = new SingletonWindow(background,
+                                               width ? width : Xpixels,
+                                               height ? height : Ypixels);
                if (!instance_) { // Support MSVC6 non-standard new behaviour.
                   throw std::bad_alloc();
                }
             }    
+            else if ((width && width != instance_->Width())
+                     || (height && height != instance_->Height())) {
+               // there is only one window to share
+               throw playpen::exception(playpen::exception::error,
+                    "A playpen of a different size already exists.");
+            }
             ++refCount_;
             return instance_;
          }
@@ -1140,37 +1902,197 @@
             }
          }
       
-          SingletonWindow::SingletonWindow(hue background) :
-            pixels_(background),
+          SingletonWindow::SingletonWindow(hue background, int width,
+                                           int height) :
+            pixels_(width, height, background),
             impl_(pixels_, hueRGBs_),
-            background_(background) {}
+            background_(background) {
+            pixels_.ClearDirty();
+            fillStack_.reserve(4 * height);
+         }
       
         // Simply set the appropriate location in the array.
           void SingletonWindow::Plot(int x, int y, hue c, plotmode pm) {
-            if (x < 0 || x >= Xpixels) 
+            if (x < 0 || x >= pixels_.width) {
+               PLAYPEN_COUNT(pixels_clipped, 1);
                return; // if out of bounds, ignore
-            if (y < 0 || y >= Ypixels) 
+            }
+            if (y < 0 || y >= pixels_.height) {
+               PLAYPEN_COUNT(pixels_clipped, 1);
                return; // i.e. it is not an error
+            }
             // the above is cleanest here as it allows easy scaling at top level
+            hue& p = pixels_.Row(y)[x];
             switch (pm) {
-               case direct:  pixels_.p[y][x] = c;                        
+               case direct:  p = c;                        
                   break;
-               case filter:  pixels_.p[y][x] = hue(c & pixels_.p[y][x]); 
+               case filter:  p = hue(c & p); 
                   break;
-               case additive:pixels_.p[y][x] = hue(c | pixels_.p[y][x]); 
+               case additive:p = hue(c | p); 
                   break;
-               case disjoint:pixels_.p[y][x] = hue(c ^ pixels_.p[y][x]); 
+               case disjoint:p = hue(c ^ p); 
                   break;
             }
+            PLAYPEN_COUNT(pixels_plotted, 1);
+            pixels_.MarkDirty(x, y);
          }     
+
+        // Clip once, then work along whole rows.
+          void SingletonWindow::FillRect(int left, int top, int right,
+                                         int bottom, hue c, plotmode pm) {
+            unsigned long const wanted = RectArea(left, top, right, bottom);
+            if (left < 0) left = 0;
+            if (top < 0) top = 0;
+            if (right >= pixels_.width) right = pixels_.width - 1;
+            if (bottom >= pixels_.height) bottom = pixels_.height - 1;
+            unsigned long const plotted = RectArea(left, top, right, bottom);
+            PLAYPEN_COUNT(pixels_plotted, plotted);
+            PLAYPEN_COUNT(pixels_clipped, wanted - plotted);
+            if (plotted == 0) 
+               return;
+            for (int y = top; y <= bottom; ++y) {
+               CombineSpan(pixels_.Row(y) + left, right - left + 1, c, pm);
+            }
+            pixels_.MarkDirty(left, top, right, bottom);
+         }
+
+        // Clip the line to the canvas once, then step along it in the
+        // pixel buffer a tile's length at a time so that only the tiles
+        // it crosses are marked dirty.
+          void SingletonWindow::Line(int x0, int y0, int x1, int y1,
+                                     hue c, plotmode pm) {
+            LineSteps line(x0, y0, x1, y1);
+            int const wanted = line.count;
+            line.Clip(0, 0, pixels_.width - 1, pixels_.height - 1);
+            PLAYPEN_COUNT(pixels_plotted, line.count);
+            PLAYPEN_COUNT(pixels_clipped, wanted - line.count);
+            while (line.count > 0) {
+               int const n = line.count < Pixels::TileSize 
+                  ? line.count : int(Pixels::TileSize);
+               int const fromX = line.x;
+               int const fromY = line.y;
+               CombineLine(pixels_.Row(0), pixels_.stride, line, n, c, pm);
+               // line.x, line.y is now one step past the last pixel
+               int left = fromX < line.x ? fromX : line.x;
+               int right = fromX < line.x ? line.x : fromX;
+               int top = fromY < line.y ? fromY : line.y;
+               int bottom = fromY < line.y ? line.y : fromY;
+               if (left < 0) left = 0;
+               if (top < 0) top = 0;
+               if (right >= pixels_.width) right = pixels_.width - 1;
+               if (bottom >= pixels_.height) bottom = pixels_.height - 1;
+               pixels_.MarkDirty(left, top, right, bottom);
+            }
+         }
+
+        // The span stack and bands are kept from one fill to the next so
+        // that their storage is only allocated once.
+          void SingletonWindow::FillRegion(int x, int y, FillTest const & test,
+                                           hue c) {
+            if (x < 0 || x >= pixels_.width || y < 0 || y >= pixels_.height) 
+               return;
+            int left, top, right, bottom;
+            int const threads = FillThreads();
+            int const filled = threads > 1 
+               && pixels_.width * pixels_.height >= ParallelFillPixels
+               ? ParallelFloodFill(pixels_.Row(0), pixels_.stride,
+                                   pixels_.width, pixels_.height, x, y,
+                                   test, c, threads, fillBands_,
+                                   left, top, right, bottom)
+               : FloodFill(pixels_.Row(0), pixels_.stride,
+                           pixels_.width, pixels_.height, x, y,
+                           test, c, fillStack_,
+                           left, top, right, bottom);
+            PLAYPEN_COUNT(pixels_plotted, filled);
+            if (filled) 
+               pixels_.MarkDirty(left, top, right, bottom);
+         }
+
+        // Both work row by row on the clipped rectangle, marking dirty
+        // only the stretch of each row that actually changed.
+          void SingletonWindow::Replace(int left, int top, int right,
+                                        int bottom, hue from, hue to) {
+            if (!ClipToCanvas(left, top, right, bottom)) 
+               return;
+            for (int y = top; y <= bottom; ++y) {
+               int first, last;
+               if (ReplaceSpan(pixels_.Row(y) + left, right - left + 1,
+                               from, to, first, last)) 
+                  pixels_.MarkDirty(left + first, y, left + last, y);
+            }
+         }
+      
+          void SingletonWindow::Remap(int left, int top, int right,
+                                      int bottom, unsigned char const * table) {
+            if (!ClipToCanvas(left, top, right, bottom)) 
+               return;
+            for (int y = top; y <= bottom; ++y) {
+               int first, last;
+               if (RemapSpan(pixels_.Row(y) + left, right - left + 1,
+                             table, first, last)) 
+                  pixels_.MarkDirty(left + first, y, left + last, y);
+            }
+         }
+      
+        // Like fillStack_ the labeller's working space is kept for reuse.
+          unsigned SingletonWindow::Label(bool eightConnected, unsigned * labels,
+                                          std::vector<playpen::region> & regions) {
+            return LabelRegions(pixels_.Row(0), pixels_.stride, pixels_.width,
+                                pixels_.height, eightConnected, labels, regions,
+                                labelRuns_, labelParents_);
+         }
+      
+        // Counts the pixels kept and lost as FillRect does.
+          bool SingletonWindow::ClipToCanvas(int & left, int & top,
+                                             int & right, int & bottom) const {
+            unsigned long const wanted = RectArea(left, top, right, bottom);
+            if (left < 0) left = 0;
+            if (top < 0) top = 0;
+            if (right >= pixels_.width) right = pixels_.width - 1;
+            if (bottom >= pixels_.height) bottom = pixels_.height - 1;
+            unsigned long const kept = RectArea(left, top, right, bottom);
+            PLAYPEN_COUNT(pixels_plotted, kept);
+            PLAYPEN_COUNT(pixels_clipped, wanted - kept);
+            return kept != 0;
+         }
+      
+        // Clip the block against the canvas and copy what is left row by
+        // row.
+          void SingletonWindow::CopyIn(int left, int top, int width, int height,
+                                       hue const * src, int stride) {
+            unsigned long const wanted = 
+               RectArea(left, top, left + width - 1, top + height - 1);
+            if (left < 0) { width += left; src -= left; left = 0; }
+            if (top < 0) { height += top; src -= top * stride; top = 0; }
+            if (left + width > pixels_.width) width = pixels_.width - left;
+            if (top + height > pixels_.height) height = pixels_.height - top;
+            unsigned long const copied = 
+               RectArea(left, top, left + width - 1, top + height - 1);
+            PLAYPEN_COUNT(pixels_plotted, copied);
+            PLAYPEN_COUNT(pixels_clipped, wanted - copied);
+            if (copied == 0) 
+               return;
+            for (int y = 0; y != height; ++y) {
+               memcpy(pixels_.Row(top + y) + left, src + y * stride, width);
+            }
+            pixels_.MarkDirty(left, top, left + width - 1, top + height - 1);
+         }
       
         // GSL: Added for MiniPNG support.
           hue SingletonWindow::GetPixel(int x, int y) const {
-            if (x < 0 || x >= Xpixels || y < 0 || y >= Ypixels) {
+            if (x < 0 || x >= pixels_.width || y < 0 || y >= pixels_.height) {
                throw playpen::exception(playpen::exception::error,
                     "Co-ordinates out of range in SingletonWindow::GetPixel.");
             }
-            return pixels_.p[y][x];
+            return pixels_.Row(y)[x];
+         }
+      
+          hue const * SingletonWindow::GetRow(int y) const {
+            if (y < 0 || y >= pixels_.height) {
+               throw playpen::exception(playpen::exception::error,
+                    "Row out of range in SingletonWindow::GetRow.");
+            }
+            return pixels_.Row(y);
          }
       
           void SingletonWindow::SetPaletteEntry(hue h, HueRGB const & rgb) {
@@ -1181,16 +2103,56 @@
             return hueRGBs_.rgbs[h];    
          }
       
+      // A save starts with SaveMagic and the canvas's width and height,
+      // which Restore checks before changing anything. Files from before
+      // the header have none and start with the background; Restore takes
+      // those only on a canvas of the default size they were saved from.
+         namespace {
+            char const SaveMagic[4] = {'F', 'G', 'W', 'P'};
+         }
+      
           ostream& SingletonWindow::Save(ostream & out) {
+            out.write(SaveMagic, sizeof(SaveMagic));
+            out.write((char*)&pixels_.width, sizeof(pixels_.width));
+            out.write((char*)&pixels_.height, sizeof(pixels_.height));
             out.write((char*)&background_, sizeof(background_));
             out.write((char*)&hueRGBs_, sizeof(hueRGBs_)); 
-            out.write((char*)pixels_.p[0], sizeof(hue)*Xpixels*Ypixels);
+            for (int y = 0; y != pixels_.height; ++y) {
+               out.write((char*)pixels_.Row(y), sizeof(hue)*pixels_.width);
+            }
             return out;
          }
           istream& SingletonWindow::Restore(istream & inp){
-            inp.read((char*)&background_, sizeof(background_));
-            inp.read((char*)&hueRGBs_, sizeof(hueRGBs_));
-            inp.read((char*)pixels_.p[0], sizeof(hue)*Xpixels*Ypixels);
+         // the background and palette, read whole before either is set
+            char head[sizeof(background_) + sizeof(hueRGBs_)];
+            char magic[sizeof(SaveMagic)];
+            inp.read(magic, sizeof(magic));
+            if (inp && memcmp(magic, SaveMagic, sizeof(magic)) == 0) {
+               int width = 0;
+               int height = 0;
+               inp.read((char*)&width, sizeof(width));
+               inp.read((char*)&height, sizeof(height));
+               if (width != pixels_.width || height != pixels_.height) {
+                  inp.setstate(std::ios::failbit);
+               }
+               inp.read(head, sizeof(head));
+            }
+            else if (pixels_.width != Xpixels || pixels_.height != Ypixels) {
+               inp.setstate(std::ios::failbit);
+            }
+            else {
+            // a file without the header: magic was the start of head
+               memcpy(head, magic, sizeof(magic));
+               inp.read(head + sizeof(magic), sizeof(head) - sizeof(magic));
+            }
+            if (!inp) {
+               return inp;
+            }
+            memcpy(&background_, head, sizeof(background_));
+            memcpy(&hueRGBs_, head + sizeof(background_), sizeof(hueRGBs_));
+            for (int y = 0; y != pixels_.height; ++y) {
+               inp.read((char*)pixels_.Row(y), sizeof(hue)*pixels_.width);
+            }
             UpdatePalette();
             Display();
             return inp;
@@ -1204,13 +2166,28 @@
     // The one SingletonWindow shared by all playpen objects.
     /*static*/ detail::SingletonWindow *  playpen::graphicswindow = 0;
     
-       playpen::playpen(hue background)
-        : pmode(direct),xorg(Xpixels/2), yorg(Ypixels/2) {
+       playpen::playpen(hue background) : pmode(direct) {
          graphicswindow = detail::SingletonWindow::GetWindow(background);
          if (!graphicswindow) {
             throw playpen::exception(playpen::exception::fatal, 
                     "Could not get window handle in playpen constructor.");
          }
+         xorg = graphicswindow->Width()/2;
+         yorg = graphicswindow->Height()/2;
+         rgbpalette();    
+      }
+   
+       playpen::playpen(int w, int h, hue background) 
+        : pmode(direct), xorg(w/2), yorg(h/2) {
+         if (w <= 0 || h <= 0) {
+            throw playpen::exception(playpen::exception::error, 
+                    "Playpen width and height must be positive.");
+         }
+         graphicswindow = detail::SingletonWindow::GetWindow(background, w, h);
+         if (!graphicswindow) {
+            throw playpen::exception(playpen::exception::fatal, 
+                    "Could not get window handle in playpen constructor.");
+         }
          rgbpalette();    
       }
        playpen::playpen(playpen const & pp)
@@ -1227,6 +2204,15 @@
          graphicswindow->ReleaseWindow();    
       }
    
+    // The size of the canvas in pixels, as the window has it.
+       int playpen::width() const {
+         return graphicswindow->Width();
+      }
+   
+       int playpen::height() const {
+         return graphicswindow->Height();
+      }
+   
     // Allows the plotmode state to be changed. Might consider making that
     // part of the state of a playpen rather than of the SingletonWindow
     // instance
@@ -1241,9 +2227,14 @@
          out.write((char*)this, sizeof(this));
          return graphicswindow->Save(out);
       }
+   // The playpen's own bytes are only copied in once the window has
+   // accepted the stream, so a mismatched one leaves this as it was.
        istream & playpen::restore(istream & inp) {
-         inp.read((char*)this, sizeof(this));
-         return graphicswindow->Restore(inp);
+         char state[sizeof(this)];
+         if (inp.read(state, sizeof(state)) && graphicswindow->Restore(inp)) {
+            memcpy((char*)this, state, sizeof(state));
+         }
+         return inp;
       }
    
        playpen const & playpen::display() const {
@@ -1266,6 +2257,102 @@
          }          
          return *this;
       }
+
+    // Bulk plotting: work out the raw rectangle covered by the logical
+    // pixels once and let SingletonWindow clip and fill it.
+       playpen& playpen::plot_span(int x, int y, int length, hue c){
+         return fill_rect(x, y, length, 1, c);
+      }
+   
+       playpen& playpen::fill_rect(int x, int y, int width, int height, hue c){
+         if (width <= 0 || height <= 0) 
+            return *this;
+         int const s = pixsize.size();
+         int const left = xorg + x*s;
+         int const bottom = yorg - y*s;
+         graphicswindow->FillRect(left, bottom - height*s + 1,
+                                  left + width*s - 1, bottom, c, pmode);
+         return *this;
+      }
+   
+    // Recolouring: the logical rectangle becomes a raw one as in fill_rect.
+       playpen& playpen::replace_all(hue from, hue to){
+         graphicswindow->Replace(0, 0, width() - 1, height() - 1, from, to);
+         return *this;
+      }
+   
+       playpen& playpen::replace_all(hue from, hue to,
+                                     int x, int y, int width, int height){
+         if (width <= 0 || height <= 0) 
+            return *this;
+         int const s = pixsize.size();
+         int const left = xorg + x*s;
+         int const bottom = yorg - y*s;
+         graphicswindow->Replace(left, bottom - height*s + 1,
+                                 left + width*s - 1, bottom, from, to);
+         return *this;
+      }
+   
+       playpen& playpen::remap(unsigned char const table[256]){
+         graphicswindow->Remap(0, 0, width() - 1, height() - 1, table);
+         return *this;
+      }
+   
+       playpen& playpen::remap(unsigned char const table[256],
+                               int x, int y, int width, int height){
+         if (width <= 0 || height <= 0) 
+            return *this;
+         int const s = pixsize.size();
+         int const left = xorg + x*s;
+         int const bottom = yorg - y*s;
+         graphicswindow->Remap(left, bottom - height*s + 1,
+                               left + width*s - 1, bottom, table);
+         return *this;
+      }
+   
+       playpen& playpen::plot_points(point const * pts, int n, hue c){
+         int const s = pixsize.size();
+         if (s == 1) {
+            for (int k = 0; k < n; ++k) {
+               graphicswindow->Plot(xorg + pts[k].x, yorg - pts[k].y, c, pmode);
+            }
+         }
+         else {
+            for (int k = 0; k < n; ++k) {
+               int const left = xorg + pts[k].x*s;
+               int const bottom = yorg - pts[k].y*s;
+               graphicswindow->FillRect(left, bottom - s + 1, left + s - 1,
+                                        bottom, c, pmode);
+            }
+         }
+         return *this;
+      }
+   
+    // At scale 1 the line goes straight to the pixel buffer. Otherwise it
+    // is stepped in logical pixels, clipped to those whose blocks touch
+    // the canvas, and each block is filled.
+       playpen& playpen::plot_line(int x0, int y0, int x1, int y1, hue c){
+         int const s = pixsize.size();
+         if (s == 1) {
+            graphicswindow->Line(xorg + x0, yorg - y0, xorg + x1, yorg - y1,
+                                 c, pmode);
+            return *this;
+         }
+         detail::LineSteps line(x0, y0, x1, y1);
+         int const width = graphicswindow->Width();
+         int const height = graphicswindow->Height();
+         line.Clip(int(floor(double(-xorg) / s)), 
+                   int(floor(double(yorg - height + 1) / s)),
+                   int(floor(double(width - 1 - xorg) / s)), 
+                   int(floor(double(yorg) / s)));
+         for (; line.count > 0; line.Step()) {
+            int const left = xorg + line.x*s;
+            int const bottom = yorg - line.y*s;
+            graphicswindow->FillRect(left, bottom - s + 1, left + s - 1,
+                                     bottom, c, pmode);
+         }
+         return *this;
+      }
    
     // 12/12/02 function to return hue of pixel allowing for origin and
     // scale. FGW
@@ -1333,9 +2420,40 @@
          return graphicswindow->GetPixel(x, y);
       }
    
+       hue const * playpen::getrawrow(int y) const {
+         return graphicswindow->GetRow(y);
+      }
+   
        void playpen::setrawpixel(int x, int y, hue h) {
          graphicswindow->Plot(x, y, h, direct);
       }
+
+       void playpen::setrawpixels(int x, int y, int width, int height,
+                                  hue const * src, int stride) {
+         graphicswindow->CopyIn(x, y, width, height, src, stride);
+      }
+   
+       void playpen::fillrawregion(int x, int y, hue h, hue boundary) {
+         detail::FillTest const test = {boundary, h, false};
+         graphicswindow->FillRegion(x, y, test, h);
+      }
+   
+       void playpen::replacerawregion(int x, int y, hue h) {
+         if (x < 0 || x >= width() || y < 0 || y >= height()) 
+            return;
+         hue const old = getrawpixel(x, y);
+         if (old == h) 
+            return;
+         detail::FillTest const test = {old, old, true};
+         graphicswindow->FillRegion(x, y, test, h);
+      }
+   
+       unsigned playpen::labelrawregions(std::vector<unsigned> & labels,
+                                         std::vector<region> & regions,
+                                         bool eight_connected) const {
+         labels.resize(std::size_t(width()) * height());
+         return graphicswindow->Label(eight_connected, &labels[0], regions);
+      }
    
     // **********************************************************************
    
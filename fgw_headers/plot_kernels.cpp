@@ -0,0 +1,778 @@
+#include "plot_kernels.h"
+#include <string.h>		// For memset.
+#include <algorithm>
+#include <cmath>
+
+// The vector kernels need GCC (or MinGW) on x86. Everything else gets
+// the scalar loops only.
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define FGW_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace studentgraphics {
+	namespace detail {
+		namespace {
+			typedef unsigned char byte;
+			// The kernels treat a row of hues as a row of bytes.
+			typedef char hue_is_one_byte[sizeof(hue) == 1 ? 1 : -1];
+
+			typedef void (*combiner)(byte * dst, int n, byte h, plotmode pm);
+
+	// direct is a fill, and the library memset is already as fast as
+	// anything written here, so every version hands it over.
+			void CombineScalar(byte * dst, int n, byte h, plotmode pm){
+				switch(pm){
+				case direct:
+					memset(dst, h, n);
+					break;
+				case filter:
+					for(int i = 0; i != n; ++i) dst[i] &= h;
+					break;
+				case additive:
+					for(int i = 0; i != n; ++i) dst[i] |= h;
+					break;
+				case disjoint:
+					for(int i = 0; i != n; ++i) dst[i] ^= h;
+					break;
+				}
+			}
+
+#ifdef FGW_X86_KERNELS
+	// 16 bytes at a time, leaving the last n % 16 to the scalar loops.
+			__attribute__((target("sse2")))
+			void CombineSSE2(byte * dst, int n, byte h, plotmode pm){
+				if(pm == direct){
+					memset(dst, h, n);
+					return;
+				}
+				__m128i const v(_mm_set1_epi8(char(h)));
+				int i(0);
+				switch(pm){
+				case filter:
+					for(; i + 16 <= n; i += 16){
+						__m128i * p(reinterpret_cast<__m128i *>(dst + i));
+						_mm_storeu_si128(p, _mm_and_si128(_mm_loadu_si128(p), v));
+					}
+					break;
+				case additive:
+					for(; i + 16 <= n; i += 16){
+						__m128i * p(reinterpret_cast<__m128i *>(dst + i));
+						_mm_storeu_si128(p, _mm_or_si128(_mm_loadu_si128(p), v));
+					}
+					break;
+				case disjoint:
+					for(; i + 16 <= n; i += 16){
+						__m128i * p(reinterpret_cast<__m128i *>(dst + i));
+						_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), v));
+					}
+					break;
+				default:
+					break;
+				}
+				CombineScalar(dst + i, n - i, h, pm);
+			}
+
+	// 32 bytes at a time, leaving the tail to the SSE2 version.
+			__attribute__((target("avx2")))
+			void CombineAVX2(byte * dst, int n, byte h, plotmode pm){
+				if(pm == direct){
+					memset(dst, h, n);
+					return;
+				}
+				__m256i const v(_mm256_set1_epi8(char(h)));
+				int i(0);
+				switch(pm){
+				case filter:
+					for(; i + 32 <= n; i += 32){
+						__m256i * p(reinterpret_cast<__m256i *>(dst + i));
+						_mm256_storeu_si256(p, _mm256_and_si256(_mm256_loadu_si256(p), v));
+					}
+					break;
+				case additive:
+					for(; i + 32 <= n; i += 32){
+						__m256i * p(reinterpret_cast<__m256i *>(dst + i));
+						_mm256_storeu_si256(p, _mm256_or_si256(_mm256_loadu_si256(p), v));
+					}
+					break;
+				case disjoint:
+					for(; i + 32 <= n; i += 32){
+						__m256i * p(reinterpret_cast<__m256i *>(dst + i));
+						_mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), v));
+					}
+					break;
+				default:
+					break;
+				}
+				CombineSSE2(dst + i, n - i, h, pm);
+			}
+#endif
+
+			combiner ChooseCombiner(){
+#ifdef FGW_X86_KERNELS
+				__builtin_cpu_init();
+				if(__builtin_cpu_supports("avx2")) return CombineAVX2;
+				if(__builtin_cpu_supports("sse2")) return CombineSSE2;
+#endif
+				return CombineScalar;
+			}
+
+	// Pixel operations for the line stepper.
+			struct set_pixel {
+				byte h;
+				void operator()(byte & p)const {p = h;}
+			};
+			struct and_pixel {
+				byte h;
+				void operator()(byte & p)const {p &= h;}
+			};
+			struct or_pixel {
+				byte h;
+				void operator()(byte & p)const {p |= h;}
+			};
+			struct xor_pixel {
+				byte h;
+				void operator()(byte & p)const {p ^= h;}
+			};
+
+			template<class Op>
+			void StepLine(byte * origin, int stride, LineSteps & line, int n, Op op){
+				long const major_delta(line.xMajor ? line.stepX : long(line.stepY) * stride);
+				long const minor_delta(line.xMajor ? long(line.stepY) * stride : line.stepX);
+				long offset(long(line.y) * stride + line.x);
+				line_int error(line.error);
+				int minor_steps(0);
+				for(int i = 0; i != n; ++i){
+					op(origin[offset]);
+					offset += major_delta;
+					error += line.minor2;
+					if(error >= line.major2){
+						error -= line.major2;
+						offset += minor_delta;
+						++minor_steps;
+					}
+				}
+				if(line.xMajor){
+					line.x += n * line.stepX;
+					line.y += minor_steps * line.stepY;
+				}
+				else {
+					line.y += n * line.stepY;
+					line.x += minor_steps * line.stepX;
+				}
+				line.error = error;
+				line.count -= n;
+			}
+
+	// Recolouring. Each returns whether any pixel changed and, if so, the
+	// first and last that did, so that the caller need only mark those
+	// dirty.
+			typedef bool (*replacer)(byte * dst, int n, byte from, byte to,
+									 int & first, int & last);
+			typedef bool (*remapper)(byte * dst, int n, byte const * table,
+									 int & first, int & last);
+
+			inline void Changed(int i, int & first, int & last){
+				if(first < 0) first = i;
+				last = i;
+			}
+
+			bool ReplaceScalar(byte * dst, int n, byte from, byte to,
+							   int & first, int & last){
+				first = -1;
+				for(int i = 0; i != n; ++i){
+					if(dst[i] == from){
+						dst[i] = to;
+						Changed(i, first, last);
+					}
+				}
+				return first >= 0;
+			}
+
+			bool RemapScalar(byte * dst, int n, byte const * table,
+							 int & first, int & last){
+				first = -1;
+				for(int i = 0; i != n; ++i){
+					byte const to(table[dst[i]]);
+					if(to != dst[i]){
+						dst[i] = to;
+						Changed(i, first, last);
+					}
+				}
+				return first >= 0;
+			}
+
+#ifdef FGW_X86_KERNELS
+	// Adds the changes made to the tail starting at i.
+			inline void MergeTail(bool changed, int i, int const & tail_first,
+								  int const & tail_last, int & first, int & last){
+				if(changed){
+					if(first < 0) first = i + tail_first;
+					last = i + tail_last;
+				}
+			}
+
+	// Compare and blend: the pixels equal to from take to, the rest are
+	// kept.
+			__attribute__((target("sse2")))
+			bool ReplaceSSE2(byte * dst, int n, byte from, byte to,
+							 int & first, int & last){
+				__m128i const f(_mm_set1_epi8(char(from)));
+				__m128i const t(_mm_set1_epi8(char(to)));
+				first = -1;
+				int i(0);
+				for(; i + 16 <= n; i += 16){
+					__m128i * p(reinterpret_cast<__m128i *>(dst + i));
+					__m128i const v(_mm_loadu_si128(p));
+					__m128i const m(_mm_cmpeq_epi8(v, f));
+					unsigned const bits(_mm_movemask_epi8(m));
+					if(bits){
+						_mm_storeu_si128(p, _mm_or_si128(_mm_andnot_si128(m, v), _mm_and_si128(m, t)));
+						if(first < 0) first = i + __builtin_ctz(bits);
+						last = i + 31 - __builtin_clz(bits);
+					}
+				}
+				int tail_first, tail_last;
+				MergeTail(ReplaceScalar(dst + i, n - i, from, to, tail_first, tail_last),
+						  i, tail_first, tail_last, first, last);
+				return first >= 0;
+			}
+
+			__attribute__((target("avx2")))
+			bool ReplaceAVX2(byte * dst, int n, byte from, byte to,
+							 int & first, int & last){
+				__m256i const f(_mm256_set1_epi8(char(from)));
+				__m256i const t(_mm256_set1_epi8(char(to)));
+				first = -1;
+				int i(0);
+				for(; i + 32 <= n; i += 32){
+					__m256i * p(reinterpret_cast<__m256i *>(dst + i));
+					__m256i const v(_mm256_loadu_si256(p));
+					__m256i const m(_mm256_cmpeq_epi8(v, f));
+					unsigned const bits(_mm256_movemask_epi8(m));
+					if(bits){
+						_mm256_storeu_si256(p, _mm256_blendv_epi8(v, t, m));
+						if(first < 0) first = i + __builtin_ctz(bits);
+						last = i + 31 - __builtin_clz(bits);
+					}
+				}
+				// Not ReplaceSSE2: mixing its legacy SSE code with the AVX
+				// state costs more than the short tail does.
+				int tail_first, tail_last;
+				MergeTail(ReplaceScalar(dst + i, n - i, from, to, tail_first, tail_last),
+						  i, tail_first, tail_last, first, last);
+				return first >= 0;
+			}
+
+	// A 256 entry lookup as 16 pshufb lookups into 16 entry slices of the
+	// table, each kept only where the high nibble picks that slice.
+			__attribute__((target("avx2")))
+			bool RemapAVX2(byte * dst, int n, byte const * table,
+						   int & first, int & last){
+				__m256i slices[16];
+				for(int h = 0; h != 16; ++h){
+					slices[h] = _mm256_broadcastsi128_si256(
+						_mm_loadu_si128(reinterpret_cast<__m128i const *>(table + 16 * h)));
+				}
+				__m256i const nibble(_mm256_set1_epi8(0x0f));
+				first = -1;
+				int i(0);
+				for(; i + 32 <= n; i += 32){
+					__m256i * p(reinterpret_cast<__m256i *>(dst + i));
+					__m256i const v(_mm256_loadu_si256(p));
+					__m256i const low(_mm256_and_si256(v, nibble));
+					__m256i const high(_mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+					__m256i result(_mm256_setzero_si256());
+					for(int h = 0; h != 16; ++h){
+						__m256i const in_slice(_mm256_cmpeq_epi8(high, _mm256_set1_epi8(char(h))));
+						result = _mm256_or_si256(result,
+							_mm256_and_si256(in_slice, _mm256_shuffle_epi8(slices[h], low)));
+					}
+					unsigned const bits(~unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(result, v))));
+					if(bits){
+						_mm256_storeu_si256(p, result);
+						if(first < 0) first = i + __builtin_ctz(bits);
+						last = i + 31 - __builtin_clz(bits);
+					}
+				}
+				int tail_first, tail_last;
+				MergeTail(RemapScalar(dst + i, n - i, table, tail_first, tail_last),
+						  i, tail_first, tail_last, first, last);
+				return first >= 0;
+			}
+#endif
+
+			replacer ChooseReplacer(){
+#ifdef FGW_X86_KERNELS
+				__builtin_cpu_init();
+				if(__builtin_cpu_supports("avx2")) return ReplaceAVX2;
+				if(__builtin_cpu_supports("sse2")) return ReplaceSSE2;
+#endif
+				return ReplaceScalar;
+			}
+
+			remapper ChooseRemapper(){
+#ifdef FGW_X86_KERNELS
+				__builtin_cpu_init();
+				if(__builtin_cpu_supports("avx2")) return RemapAVX2;
+#endif
+				return RemapScalar;
+			}
+
+	// The flood fill's run finders. RunRight gives the first pixel from x
+	// on (and before end) that fails test, or end; RunLeft the leftmost
+	// pixel of the passing run that ends at x. Both look at 16 pixels at a
+	// time where SSE2 is available.
+			inline bool Passes(byte p, FillTest const & test){
+				return (p == test.a.value() or p == test.b.value()) == test.throughMatch;
+			}
+
+#if defined(FGW_X86_KERNELS) && defined(__SSE2__)
+			inline int StopMask(byte const * p, FillTest const & test){
+				__m128i const v(_mm_loadu_si128(reinterpret_cast<__m128i const *>(p)));
+				int const match(_mm_movemask_epi8(_mm_or_si128(
+					_mm_cmpeq_epi8(v, _mm_set1_epi8(char(test.a.value()))),
+					_mm_cmpeq_epi8(v, _mm_set1_epi8(char(test.b.value()))))));
+				return test.throughMatch ? ~match & 0xffff : match;
+			}
+#endif
+
+			int RunRight(byte const * row, int x, int end, FillTest const & test){
+#if defined(FGW_X86_KERNELS) && defined(__SSE2__)
+				for(; x + 16 <= end; x += 16){
+					int const stop(StopMask(row + x, test));
+					if(stop) return x + __builtin_ctz(stop);
+				}
+#endif
+				while(x != end and Passes(row[x], test)) ++x;
+				return x;
+			}
+
+			int RunLeft(byte const * row, int x, FillTest const & test){
+#if defined(FGW_X86_KERNELS) && defined(__SSE2__)
+				for(; x >= 15; x -= 16){
+					int const stop(StopMask(row + x - 15, test));
+					if(stop) return x - 15 + (32 - __builtin_clz(stop));
+				}
+#endif
+				while(x >= 0 and Passes(row[x], test)) --x;
+				return x + 1;
+			}
+
+	// The labeller's union-find forest. Each tree is rooted at its lowest
+	// numbered run, which Join keeps so, so that every parent comes before
+	// its child.
+			unsigned FindRoot(std::vector<unsigned> & parents, unsigned i){
+				while(parents[i] != i){
+					parents[i] = parents[parents[i]];
+					i = parents[i];
+				}
+				return i;
+			}
+
+			void Join(std::vector<unsigned> & parents, unsigned a, unsigned b){
+				a = FindRoot(parents, a);
+				b = FindRoot(parents, b);
+				if(a < b) parents[b] = a;
+				else if(b < a) parents[a] = b;
+			}
+
+	// How far the minor co-ordinate has moved after k more steps, for
+	// 0 <= k < count, which is (error + k*minor2) / major2. With count an
+	// int that sum is under 2^63, so line_int holds it exactly.
+			line_int MinorOffset(LineSteps const & line, double k){
+				return (line.error + line_int(k) * line.minor2) / line.major2;
+			}
+		}
+
+		LineSteps::LineSteps(int x0, int y0, int x1, int y1)
+			: x(x0), y(y0), stepX(x1 < x0 ? -1 : 1), stepY(y1 < y0 ? -1 : 1){
+			line_int const dx(x1 < x0 ? line_int(x0) - x1 : line_int(x1) - x0);
+			line_int const dy(y1 < y0 ? line_int(y0) - y1 : line_int(y1) - y0);
+			xMajor = dx >= dy;
+			count = int(xMajor ? dx : dy);
+			major2 = 2 * line_int(count);
+			minor2 = 2 * (xMajor ? dy : dx);
+			// start half way so that the minor co-ordinate is rounded
+			error = count;
+		}
+
+		bool LineSteps::Clip(int left, int top, int right, int bottom){
+			if(count <= 0) return false;
+			int const major(xMajor ? x : y);
+			int const major_step(xMajor ? stepX : stepY);
+			int const major_low(xMajor ? left : top);
+			int const major_high(xMajor ? right : bottom);
+			int const minor(xMajor ? y : x);
+			int const minor_step(xMajor ? stepY : stepX);
+			int const minor_low(xMajor ? top : left);
+			int const minor_high(xMajor ? bottom : right);
+
+			// most lines are wholly inside, which the end points show
+			int const major_end(major + (count - 1) * major_step);
+			int const minor_end(minor + int(minor2 / 2) * minor_step);
+			if(std::min(major, major_end) >= major_low and std::max(major, major_end) <= major_high
+				and std::min(minor, minor_end) >= minor_low and std::max(minor, minor_end) <= minor_high){
+				return true;
+			}
+
+			// the major co-ordinate moves by one on every step
+			double first(0);
+			double last(count - 1);
+			if(major_step > 0){
+				first = std::max(first, double(major_low) - major);
+				last = std::min(last, double(major_high) - major);
+			}
+			else {
+				first = std::max(first, double(major) - major_high);
+				last = std::min(last, double(major) - major_low);
+			}
+			// the minor one by MinorOffset(), which never decreases
+			double const low(minor_step > 0 ? double(minor_low) - minor : double(minor) - minor_high);
+			double const high(minor_step > 0 ? double(minor_high) - minor : double(minor) - minor_low);
+			if(minor2 == 0){
+				if(low > 0 or high < 0) first = last + 1;
+			}
+			else if(first <= last){
+				// estimate the first and last steps inside, keep them to
+				// first..last, then settle any rounding in the division
+				// exactly; the doubles can be a little out for long lines
+				double enter(std::ceil((low * major2 - error) / minor2));
+				enter = std::min(std::max(enter, first), last + 1);
+				while(enter <= last and MinorOffset(*this, enter) < low) ++enter;
+				while(enter > first and MinorOffset(*this, enter - 1) >= low) --enter;
+				double leave(std::ceil(((high + 1) * major2 - error) / minor2) - 1);
+				leave = std::min(std::max(leave, first - 1), last);
+				while(leave >= first and MinorOffset(*this, leave) > high) --leave;
+				while(leave < last and MinorOffset(*this, leave + 1) <= high) ++leave;
+				first = enter;
+				last = leave;
+			}
+			if(first > last){
+				count = 0;
+				return false;
+			}
+			line_int const moved(MinorOffset(*this, first));
+			error += line_int(first) * minor2 - moved * major2;
+			int const major_moved(int(first) * major_step);
+			int const minor_moved(int(moved) * minor_step);
+			if(xMajor){
+				x += major_moved;
+				y += minor_moved;
+			}
+			else {
+				y += major_moved;
+				x += minor_moved;
+			}
+			count = int(last - first) + 1;
+			return true;
+		}
+
+		bool ReplaceSpan(hue * dst, int n, hue from, hue to, int & first, int & last){
+			static replacer const replace(ChooseReplacer());
+			if(n <= 0 or from.value() == to.value()) return false;
+			return replace(reinterpret_cast<byte *>(dst), n, from.value(), to.value(), first, last);
+		}
+
+		bool RemapSpan(hue * dst, int n, unsigned char const * table, int & first, int & last){
+			static remapper const remap(ChooseRemapper());
+			if(n <= 0) return false;
+			return remap(reinterpret_cast<byte *>(dst), n, table, first, last);
+		}
+
+	// A span fill in the style of Heckbert's: each span popped is a filled
+	// run whose neighbouring row is searched for runs to fill below it. A
+	// run found is pushed to carry on in the same direction, and any part
+	// of it sticking out past the run it came from is also pushed back the
+	// other way, as the region may turn round there.
+		int FloodFill(hue * origin, int stride, int width, int height,
+					  int x, int y, FillTest const & test, hue h,
+					  std::vector<FillSpan> & stack,
+					  int & left, int & top, int & right, int & bottom){
+			byte * const base(reinterpret_cast<byte *>(origin));
+			if(not Passes(base[long(y) * stride + x], test)) return 0;
+			FillTest seek(test);
+			seek.throughMatch = not test.throughMatch;
+
+			byte * row(base + long(y) * stride);
+			int l(RunLeft(row, x, test));
+			int r(RunRight(row, x, width, test) - 1);
+			memset(row + l, h.value(), r - l + 1);
+			int filled(r - l + 1);
+			left = l; right = r; top = bottom = y;
+			stack.clear();
+			FillSpan const down = {y, l, r, 1};
+			FillSpan const up = {y, l, r, -1};
+			stack.push_back(down);
+			stack.push_back(up);
+			while(not stack.empty()){
+				FillSpan const s(stack.back());
+				stack.pop_back();
+				int const ny(s.y + s.dy);
+				if(ny < 0 or ny >= height) continue;
+				row = base + long(ny) * stride;
+				x = RunRight(row, s.xl, s.xr + 1, seek);
+				if(x > s.xr) continue;
+				l = x == s.xl ? RunLeft(row, x, test) : x;
+				for(;;){
+					r = RunRight(row, x, width, test) - 1;
+					memset(row + l, h.value(), r - l + 1);
+					filled += r - l + 1;
+					if(l < left) left = l;
+					if(r > right) right = r;
+					if(ny < top) top = ny;
+					if(ny > bottom) bottom = ny;
+					FillSpan const on = {ny, l, r, s.dy};
+					stack.push_back(on);
+					if(l < s.xl - 1){
+						FillSpan const back = {ny, l, s.xl - 2, -s.dy};
+						stack.push_back(back);
+					}
+					if(r > s.xr + 1){
+						FillSpan const back = {ny, s.xr + 2, r, -s.dy};
+						stack.push_back(back);
+					}
+					x = r + 2 > s.xr ? r + 2 : RunRight(row, r + 2, s.xr + 1, seek);
+					if(x > s.xr) break;
+					l = x;
+				}
+			}
+			return filled;
+		}
+
+	// Runs of the row above that touch a run, and so join it if they have
+	// its hue, are those reaching to within reach of it: 0 pixels for
+	// 4-connectivity, 1 for 8. As both rows' runs are in order of x a
+	// single pass along the row above finds them all.
+		unsigned LabelRegions(hue const * origin, int stride, int width,
+							  int height, bool eightConnected,
+							  unsigned * labels,
+							  std::vector<playpen::region> & regions,
+							  std::vector<LabelRun> & runs,
+							  std::vector<unsigned> & parents){
+			byte const * const base(reinterpret_cast<byte const *>(origin));
+			int const reach(eightConnected ? 1 : 0);
+			runs.clear();
+			parents.clear();
+			regions.clear();
+			std::size_t above(0), aboveEnd(0);
+			for(int y = 0; y != height; ++y){
+				byte const * const row(base + long(y) * stride);
+				byte const * const rowAbove(row - stride);
+				std::size_t const begin(runs.size());
+				for(int x = 0; x != width;){
+					FillTest const same = {row[x], row[x], true};
+					LabelRun run = {y, x, RunRight(row, x, width, same) - 1, unsigned(runs.size())};
+					parents.push_back(run.label);
+					while(above != aboveEnd and runs[above].xr < run.xl - reach) ++above;
+					for(std::size_t a = above; a != aboveEnd and runs[a].xl <= run.xr + reach; ++a){
+						if(rowAbove[runs[a].xl] == row[x]) Join(parents, runs[a].label, run.label);
+					}
+					runs.push_back(run);
+					x = run.xr + 1;
+				}
+				above = begin;
+				aboveEnd = runs.size();
+			}
+
+			// A root keeps the number of the next region; any other run
+			// takes its parent's region number, already worked out. So the
+			// first run of each region is its root, met in region order.
+			unsigned count(0);
+			for(std::size_t i = 0; i != parents.size(); ++i){
+				parents[i] = parents[i] == i ? count++ : parents[parents[i]];
+			}
+			regions.resize(count);
+			unsigned started(0);
+			for(std::size_t i = 0; i != runs.size(); ++i){
+				LabelRun const & run(runs[i]);
+				unsigned const label(parents[i]);
+				playpen::region & r(regions[label]);
+				if(label == started){
+					++started;
+					r.shade = origin[long(run.y) * stride + run.xl];
+					r.size = 0;
+					r.left = run.xl;
+					r.right = run.xr;
+					r.top = run.y;
+				}
+				r.size += run.xr - run.xl + 1;
+				if(run.xl < r.left) r.left = run.xl;
+				if(run.xr > r.right) r.right = run.xr;
+				r.bottom = run.y;
+				std::fill(labels + long(run.y) * width + run.xl,
+						  labels + long(run.y) * width + run.xr + 1, label);
+			}
+			return count;
+		}
+
+	// The two halves of a ParallelFloodFill run by each band's thread.
+	// Runs are joined as in LabelRegions, but across any overlap, as
+	// passing pixels need not share a hue.
+		namespace {
+			void FindBandParts(void * context){
+				FillBand & band(*static_cast<FillBand *>(context));
+				byte const * const base(reinterpret_cast<byte const *>(band.origin));
+				FillTest seek(band.test);
+				seek.throughMatch = not band.test.throughMatch;
+				band.runs.clear();
+				band.parents.clear();
+				std::size_t above(0), aboveEnd(0);
+				for(int y = band.top; y <= band.bottom; ++y){
+					byte const * const row(base + long(y) * band.stride);
+					std::size_t const begin(band.runs.size());
+					for(int x = RunRight(row, 0, band.width, seek); x != band.width;
+						x = RunRight(row, x, band.width, seek)){
+						LabelRun run = {y, x, RunRight(row, x, band.width, band.test) - 1,
+										unsigned(band.runs.size())};
+						band.parents.push_back(run.label);
+						while(above != aboveEnd and band.runs[above].xr < run.xl) ++above;
+						for(std::size_t a = above; a != aboveEnd and band.runs[a].xl <= run.xr; ++a){
+							Join(band.parents, band.runs[a].label, run.label);
+						}
+						band.runs.push_back(run);
+						x = run.xr + 1;
+					}
+					above = begin;
+					aboveEnd = band.runs.size();
+				}
+				band.parts = 0;
+				for(std::size_t i = 0; i != band.parents.size(); ++i){
+					band.parents[i] = band.parents[i] == i ? band.parts++
+						: band.parents[band.parents[i]];
+					band.runs[i].label = band.parents[i];
+				}
+			}
+
+			void FillBandParts(void * context){
+				FillBand & band(*static_cast<FillBand *>(context));
+				byte * const base(reinterpret_cast<byte *>(band.origin));
+				band.filled = 0;
+				for(std::size_t i = 0; i != band.runs.size(); ++i){
+					LabelRun const & run(band.runs[i]);
+					if(not band.chosen[run.label]) continue;
+					memset(base + long(run.y) * band.stride + run.xl, band.h.value(),
+						   run.xr - run.xl + 1);
+					if(band.filled == 0){
+						band.left = run.xl;
+						band.right = run.xr;
+						band.firstRow = run.y;
+					}
+					band.filled += run.xr - run.xl + 1;
+					if(run.xl < band.left) band.left = run.xl;
+					if(run.xr > band.right) band.right = run.xr;
+					band.lastRow = run.y;
+				}
+			}
+		}
+
+	// The joining in the middle is done here, in a forest of all the
+	// bands' parts numbered one band after another.
+		int ParallelFloodFill(hue * origin, int stride, int width, int height,
+							  int x, int y, FillTest const & test, hue h,
+							  int threads, std::vector<FillBand> & bands,
+							  int & left, int & top, int & right, int & bottom){
+			byte const * const base(reinterpret_cast<byte const *>(origin));
+			if(not Passes(base[long(y) * stride + x], test)) return 0;
+			int const n(threads < height ? threads : height);
+			bands.resize(n);
+			std::vector<void *> contexts(n);
+			for(int b = 0; b != n; ++b){
+				FillBand & band(bands[b]);
+				band.origin = origin;
+				band.stride = stride;
+				band.width = width;
+				band.test = test;
+				band.h = h;
+				band.top = int(long(height) * b / n);
+				band.bottom = int(long(height) * (b + 1) / n) - 1;
+				contexts[b] = &band;
+			}
+			RunConcurrently(FindBandParts, &contexts[0], n);
+
+			std::vector<unsigned> first(n + 1, 0);
+			for(int b = 0; b != n; ++b) first[b + 1] = first[b] + bands[b].parts;
+			std::vector<unsigned> parents(first[n]);
+			for(unsigned i = 0; i != first[n]; ++i) parents[i] = i;
+			// The runs on the last row of one band against those on the
+			// first row of the next.
+			for(int b = 0; b + 1 != n; ++b){
+				std::vector<LabelRun> const & upper(bands[b].runs);
+				std::vector<LabelRun> const & lower(bands[b + 1].runs);
+				std::size_t u(upper.size());
+				while(u != 0 and upper[u - 1].y == bands[b].bottom) --u;
+				for(std::size_t l = 0; l != lower.size() and lower[l].y == bands[b + 1].top; ++l){
+					while(u != upper.size() and upper[u].xr < lower[l].xl) ++u;
+					for(std::size_t a = u; a != upper.size() and upper[a].xl <= lower[l].xr; ++a){
+						Join(parents, first[b] + upper[a].label, first[b + 1] + lower[l].label);
+					}
+				}
+			}
+			int seedBand(0);
+			while(bands[seedBand].bottom < y) ++seedBand;
+			std::vector<LabelRun> const & seedRuns(bands[seedBand].runs);
+			std::size_t s(0);
+			while(seedRuns[s].y < y or seedRuns[s].xr < x) ++s;
+			unsigned const seed(FindRoot(parents, first[seedBand] + seedRuns[s].label));
+			for(int b = 0; b != n; ++b){
+				FillBand & band(bands[b]);
+				band.chosen.resize(band.parts);
+				for(unsigned p = 0; p != band.parts; ++p){
+					band.chosen[p] = FindRoot(parents, first[b] + p) == seed;
+				}
+			}
+			RunConcurrently(FillBandParts, &contexts[0], n);
+
+			int filled(0);
+			for(int b = 0; b != n; ++b){
+				FillBand const & band(bands[b]);
+				if(band.filled == 0) continue;
+				if(filled == 0){
+					left = band.left;
+					right = band.right;
+					top = band.firstRow;
+				}
+				filled += band.filled;
+				if(band.left < left) left = band.left;
+				if(band.right > right) right = band.right;
+				bottom = band.lastRow;
+			}
+			return filled;
+		}
+
+		void CombineLine(hue * origin, int stride, LineSteps & line, int n,
+						 hue h, plotmode pm){
+			if(n <= 0) return;
+			byte * const base(reinterpret_cast<byte *>(origin));
+			switch(pm){
+			case direct: {
+				set_pixel op = {h.value()};
+				StepLine(base, stride, line, n, op);
+				break;
+			}
+			case filter: {
+				and_pixel op = {h.value()};
+				StepLine(base, stride, line, n, op);
+				break;
+			}
+			case additive: {
+				or_pixel op = {h.value()};
+				StepLine(base, stride, line, n, op);
+				break;
+			}
+			case disjoint: {
+				xor_pixel op = {h.value()};
+				StepLine(base, stride, line, n, op);
+				break;
+			}
+			}
+		}
+
+		void CombineSpan(hue * dst, int n, hue h, plotmode pm){
+			// chosen on first use so that it works for playpens that are
+			// themselves statics
+			static combiner const combine(ChooseCombiner());
+			if(n > 0) combine(reinterpret_cast<byte *>(dst), n, h, pm);
+		}
+	}
+}
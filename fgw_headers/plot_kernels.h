@@ -0,0 +1,161 @@
+#ifndef PLOT_KERNELS_H
+#define PLOT_KERNELS_H
+
+#include "playpen.h"
+#include <vector>
+
+// Bulk pixel operations used inside the playpen implementation. They
+// work on runs of raw pixels and pick SSE2 or AVX2 code at run time when
+// the processor has it, falling back to plain loops otherwise. LineSteps
+// is also used by the line drawing templates.
+namespace studentgraphics {
+	namespace detail {
+		// At least 64 bits signed, for sums that outgrow an int.
+#if defined(_MSC_VER)
+		typedef __int64 line_int;
+#else
+		typedef long long line_int;
+#endif
+
+		// Combine the n pixels starting at dst with h according to pm,
+		// exactly as n calls of SingletonWindow::Plot would.
+		void CombineSpan(hue * dst, int n, hue h, plotmode pm);
+
+		// Recolour the n pixels starting at dst: those of hue from become
+		// to, or every pixel p becomes table[p]. Each returns whether any
+		// pixel changed and, if so, sets first and last to the offsets of
+		// the first and last that did.
+		bool ReplaceSpan(hue * dst, int n, hue from, hue to, int & first, int & last);
+		bool RemapSpan(hue * dst, int n, unsigned char const * table, int & first, int & last);
+
+		// The pixels of a line from (x0, y0) towards (x1, y1) in the order
+		// Bresenham's algorithm visits them. As with drawline the end point
+		// itself is excluded, so a line has max(|dx|, |dy|) pixels, which
+		// must fit in an int.
+		struct LineSteps {
+			LineSteps(int x0, int y0, int x1, int y1);
+			// Drop the pixels outside left <= x <= right, top <= y <= bottom
+			// by solving for where the line enters and leaves the rectangle
+			// rather than stepping up to it. Returns false if none are left.
+			bool Clip(int left, int top, int right, int bottom);
+			// Move on to the next pixel.
+			void Step(){
+				if(xMajor) x += stepX; else y += stepY;
+				error += minor2;
+				if(error >= major2){
+					error -= major2;
+					if(xMajor) y += stepY; else x += stepX;
+				}
+				--count;
+			}
+
+			int x, y;			// the next pixel
+			int count;			// pixels still to come
+			int stepX, stepY;	// +1 or -1
+			bool xMajor;		// x changes on every step
+			line_int major2, minor2;	// twice |dx| and |dy|, larger first
+			line_int error;		// decides the minor steps, 0 <= error < major2
+		};
+
+		// Combine the next n pixels of line, which must all lie in the
+		// rows of stride pixels starting at origin, with h according to pm
+		// and step line past them.
+		void CombineLine(hue * origin, int stride, LineSteps & line, int n,
+						 hue h, plotmode pm);
+
+		// Which pixels a flood fill may spread through: those equal to a or
+		// b when throughMatch is true, otherwise those equal to neither.
+		struct FillTest {
+			hue a, b;
+			bool throughMatch;
+		};
+
+		// Pixels xl to xr of row y have been filled and row y + dy next to
+		// them is still to be looked at.
+		struct FillSpan {
+			int y, xl, xr, dy;
+		};
+
+		// Change every pixel 4-connected to (x, y) through pixels passing
+		// test to h, which must not itself pass. The width by height pixels
+		// are in rows stride apart from origin. Whole runs are found and
+		// filled at once, and the stack of spans still to be looked at is
+		// kept in stack so that its storage can be reused. Returns the
+		// number of pixels changed and, if any, the rectangle holding them.
+		int FloodFill(hue * origin, int stride, int width, int height,
+					  int x, int y, FillTest const & test, hue h,
+					  std::vector<FillSpan> & stack,
+					  int & left, int & top, int & right, int & bottom);
+
+		// Pixels xl to xr of row y are all of one hue, with label a
+		// provisional region number.
+		struct LabelRun {
+			int y, xl, xr;
+			unsigned label;
+		};
+
+		// Label the connected regions of the width by height pixels in rows
+		// stride apart from origin, as playpen::labelrawregions describes,
+		// writing one label per pixel to labels (row by row, width apart).
+		// One sweep breaks the rows into runs of one hue and joins the runs
+		// that touch in a union-find forest; a second numbers the regions
+		// and writes out the labels and statistics. runs and parents are
+		// working space, kept by the caller so that it can be reused.
+		unsigned LabelRegions(hue const * origin, int stride, int width,
+							  int height, bool eightConnected,
+							  unsigned * labels,
+							  std::vector<playpen::region> & regions,
+							  std::vector<LabelRun> & runs,
+							  std::vector<unsigned> & parents);
+
+		// Canvases of fewer pixels than this are always filled by
+		// FloodFill, as starting threads would cost more than it saves.
+		int const ParallelFillPixels = 1 << 19;
+
+		// A band of rows, top to bottom, of a ParallelFloodFill with the
+		// working space and results of the thread that looks after it.
+		struct FillBand {
+			hue * origin;
+			int stride, width;
+			FillTest test;
+			hue h;
+			int top, bottom;
+			std::vector<LabelRun> runs;		// runs passing test, labelled by part
+			std::vector<unsigned> parents;
+			unsigned parts;					// connected parts within the band
+			std::vector<unsigned char> chosen;	// the parts joined to the seed
+			int filled, left, right, firstRow, lastRow;
+		};
+
+		// The same fill as FloodFill, shared among threads. The canvas is
+		// cut into that many bands of rows. Each thread finds the runs of
+		// its band that pass test and joins them into connected parts;
+		// then the parts touching across band edges are joined and those
+		// connected to the seed chosen; then each thread fills the chosen
+		// runs of its band. Every pixel is looked at, however small the
+		// region, but no thread ever waits for another. bands is working
+		// space that can be reused.
+		int ParallelFloodFill(hue * origin, int stride, int width, int height,
+							  int x, int y, FillTest const & test, hue h,
+							  int threads, std::vector<FillBand> & bands,
+							  int & left, int & top, int & right, int & bottom);
+
+		// Defined by each platform's playpen source: the number of
+		// processors, and a way to call job(contexts[i]) for every i below
+		// n at once, the first on the calling thread and the rest on
+		// threads of their own, returning when all have finished.
+		int ProcessorCount();
+		void RunConcurrently(void (*job)(void *), void * const * contexts, int n);
+
+		// Also defined by each platform: a thread of its own, started with
+		// the first job, calls job(context) for each RunInBackground in
+		// turn. When queueLimit jobs are already waiting RunInBackground
+		// blocks until the thread takes the oldest. WaitForBackground
+		// returns once every job queued so far has finished. Both are for
+		// the program's own thread, as the rest of the library is.
+		void RunInBackground(void (*job)(void *), void * context, int queueLimit);
+		void WaitForBackground();
+	}
+}
+
+#endif
@@ -1,4 +1,3 @@
-#include "flood_fill.h"
 #include "line_drawing.h"
 #include "point2dx.h"
 #include "shape.h"
@@ -10,9 +9,8 @@
    // public functions
    
        void drawshape(playpen & pp, shape const & s, hue shade){
-         for(unsigned int i=0; i != (s.size()-1); ++i){
-            drawline(pp, s[i], s[i+1], shade);
-         }
+         if(not s.empty()) 
+            drawpolyline(pp, &s[0], int(s.size()), shade);
       }
    
        void moveshape(shape & s, point2d offset){
@@ -93,29 +91,270 @@
    
    
      
-       void filled_polygon(playpen & pp, shape const & s, point2d local, hue shade){
+      namespace {
+      // A polygon edge as the scanline fill sees it: the rows first to last
+      // whose centres it passes, where it crosses the first of them and
+      // which way it winds.
+          struct edge {
+            int first, last;
+            double x, slope;	// slope is the change in x per row
+            int winding;
+         };
+      
+          bool starts_before(edge const & a, edge const & b){
+            return a.first < b.first;
+         }
+      
+          struct crossing {
+            double x;
+            int winding;
+         };
+      
+          bool left_of(crossing const & a, crossing const & b){
+            return a.x < b.x;
+         }
+      
+          bool before(playpen::point const & a, playpen::point const & b){
+            return a.y < b.y or (a.y == b.y and a.x < b.x);
+         }
+      
+          bool same(playpen::point const & a, playpen::point const & b){
+            return a.x == b.x and a.y == b.y;
+         }
+      
+      // The pixels drawshape plots for s, in before order and each once:
+      // every line from one rounded vertex to the next and every vertex.
+          void outline_pixels(shape const & s, std::vector<playpen::point> & pixels){
+            pixels.clear();
+            for(unsigned i(0); i != s.size(); ++i){
+               playpen::point const to = {int(std::floor(s[i].x() + .5)), int(std::floor(s[i].y() + .5))};
+               pixels.push_back(to);
+               if(i == 0) 
+                  continue;
+               playpen::point const from = {int(std::floor(s[i-1].x() + .5)), int(std::floor(s[i-1].y() + .5))};
+               for(studentgraphics::detail::LineSteps line(from.x, from.y, to.x, to.y); line.count != 0; line.Step()){
+                  playpen::point const step = {line.x, line.y};
+                  pixels.push_back(step);
+               }
+            }
+            std::sort(pixels.begin(), pixels.end(), before);
+            pixels.erase(std::unique(pixels.begin(), pixels.end(), same), pixels.end());
+         }
+      
+      // Plot the pixels on row y whose centres are in [from, to), keeping
+      // to the columns left to right and leaving out any in skip, which is
+      // in before order.
+          void fill_span(playpen & pp, int y, double from, double to, int left, int right, hue shade,
+          std::vector<playpen::point> const & skip){
+            int first(int(std::ceil(from)));
+            int last(int(std::ceil(to)) - 1);
+            if(first < left) first = left;
+            if(last > right) last = right;
+            if(first > last) 
+               return;
+            playpen::point const start = {first, y};
+            std::vector<playpen::point>::const_iterator gap(std::lower_bound(skip.begin(), skip.end(), start, before));
+            for(; gap != skip.end() and gap->y == y and gap->x <= last; ++gap){
+               if(gap->x > first) 
+                  pp.plot_span(first, y, gap->x - first, shade);
+               first = gap->x + 1;
+            }
+            if(first <= last) 
+               pp.plot_span(first, y, last - first + 1, shade);
+         }
+      
+      // The logical co-ordinates whose pixels touch the canvas, so that the
+      // fill need not scan rows or columns that cannot be seen.
+          void visible(playpen const & pp, int & left, int & bottom, int & right, int & top){
+            int const s(pp.scale());
+            playpen::origin_data const org(pp.origin());
+            left = int(std::floor(double(-org.x()) / s));
+            right = int(std::floor(double(pp.width() - 1 - org.x()) / s));
+            bottom = int(std::floor(double(org.y() - pp.height() + 1) / s));
+            top = int(std::floor(double(org.y()) / s));
+         }
+      
+      // Active edge table scanline fill. Edges are sorted by the row they
+      // start on; on each row the ones that have started and not yet finished
+      // give their crossings, which are sorted and paired off by the rule.
+      // Pixels in skip are left alone.
+          void scan_fill(playpen & pp, point2d const * pts, int n, hue shade, fill_rule rule,
+          std::vector<playpen::point> const & skip){
+            int left, bottom, right, top;
+            visible(pp, left, bottom, right, top);
+            std::vector<edge> edges;
+            edges.reserve(n);
+            for(int i(0); i != n; ++i){
+               point2d const & a(pts[i]);
+               point2d const & b(pts[(i + 1) % n]);
+               if(a.y() == b.y()) 
+                  continue;	// horizontal edges pass no row centres
+               point2d const & low(a.y() < b.y() ? a : b);
+               point2d const & high(a.y() < b.y() ? b : a);
+            // rows y with low.y() <= y < high.y()
+               edge e;
+               e.first = int(std::ceil(low.y()));
+               e.last = int(std::ceil(high.y())) - 1;
+               if(e.first < bottom) e.first = bottom;
+               if(e.last > top) e.last = top;
+               if(e.first > e.last) 
+                  continue;
+               e.slope = (high.x() - low.x()) / (high.y() - low.y());
+               e.x = low.x() + (e.first - low.y()) * e.slope;
+               e.winding = a.y() < b.y() ? 1 : -1;
+               edges.push_back(e);
+            }
+            if(edges.empty()) 
+               return;
+            std::sort(edges.begin(), edges.end(), starts_before);
+      
+            std::vector<edge> active;
+            std::vector<crossing> crossings;
+            unsigned next(0);
+            for(int y(edges[0].first); ; ++y){
+            // drop finished edges, skip any gap and take on those starting here
+               unsigned kept(0);
+               for(unsigned i(0); i != active.size(); ++i){
+                  if(active[i].last >= y) active[kept++] = active[i];
+               }
+               active.resize(kept);
+               if(active.empty()){
+                  if(next == edges.size()) 
+                     break;
+                  if(edges[next].first > y) 
+                     y = edges[next].first;
+               }
+               while(next != edges.size() and edges[next].first == y){
+                  active.push_back(edges[next++]);
+               }
+               crossings.resize(active.size());
+               for(unsigned i(0); i != active.size(); ++i){
+                  crossings[i].x = active[i].x + (y - active[i].first) * active[i].slope;
+                  crossings[i].winding = active[i].winding;
+               }
+               std::sort(crossings.begin(), crossings.end(), left_of);
+               if(rule == even_odd){
+                  for(unsigned i(0); i + 1 < crossings.size(); i += 2){
+                     fill_span(pp, y, crossings[i].x, crossings[i + 1].x, left, right, shade, skip);
+                  }
+               }
+               else {
+                  int winding(0);
+                  double from(0);
+                  for(unsigned i(0); i != crossings.size(); ++i){
+                     if(winding == 0) from = crossings[i].x;
+                     winding += crossings[i].winding;
+                     if(winding == 0) fill_span(pp, y, from, crossings[i].x, left, right, shade, skip);
+                  }
+               }
+            }
+         }
+      }
+   
+       void filled_polygon(playpen & pp, point2d const * pts, int n, hue shade, fill_rule rule){
+         if(n >= 3) 
+            scan_fill(pp, pts, n, shade, rule, std::vector<playpen::point>());
+      }
+   
+       void filled_polygon(playpen & pp, shape const & s, hue shade, fill_rule rule){
+         if(not s.empty()) 
+            filled_polygon(pp, &s[0], int(s.size()), shade, rule);
+      }
+   
+   // The outline keeps these covering the pixels they always did. The fill
+   // leaves out the outline's pixels so that, as before, each is plotted
+   // once, which matters in the plot modes that combine.
+       void filled_polygon(playpen & pp, shape const & s, point2d, hue shade){
          if(s.size() < 3) 
             return;
+         std::vector<playpen::point> outline;
+         outline_pixels(s, outline);
+         scan_fill(pp, &s[0], int(s.size()), shade, even_odd, outline);
          drawshape(pp, s, shade);
-         seed_fill(pp, int(local.x()), int(local.y()), shade, shade);
       }
    
-   // assumes that the mean of the verteces gives an interior point
        void filled_polygon(playpen & pp, shape const & s, hue shade){
          if(s.size() < 4) 
             return; // nothing to do
-         double x_mean(0);
-         double y_mean(0);
-      // In calculating the mean I have allowed for my representation of
-      // closed shapes having the last point being a repeat of the first
-         for(unsigned int i = 0; i != s.size()-1; ++i){
-            x_mean += s[i].x();
-            y_mean += s[i].y();
-         }
-         x_mean /= s.size();
-         y_mean /= s.size();
-         filled_polygon(pp, s, point2d(x_mean, y_mean), shade);
-      }	   
+         filled_polygon(pp, s, point2d(), shade);
+      }
+   
+      namespace {
+      // The half widths of an ellipse's rows, from the middle row outwards.
+      // Row dy reaches the largest x with
+      //    (2x / (2*xradius+1))^2 + (2dy / (2*yradius+1))^2 <= 1
+      // i.e. 4*P*x*x + 4*Q*dy*dy <= P*Q. x only ever shrinks, so it is
+      // stepped down from the row before. The products are kept in doubles,
+      // which hold these integers exactly for any radius that fits on a
+      // screen.
+          class ellipse_rows {
+         public:
+             ellipse_rows(int xradius, int yradius)
+             : p(double(2*yradius + 1) * (2*yradius + 1)),
+               q(double(2*xradius + 1) * (2*xradius + 1)),
+               x(xradius), dy(0) { }
+         // the half width of the next row, -1 once past the top
+             int next(){
+               double const y_term(4 * q * dy * dy);
+               while(x >= 0 and 4 * p * x * x + y_term > p * q) --x;
+               ++dy;
+               return x;
+            }
+         private:
+            double const p, q;
+            int x, dy;
+         };
+      
+      // x - half to x + half on row y and its mirror row, which is the same
+      // row when dy is 0
+          void mirrored_span(playpen & pp, int x, int y, int dy, int from, int to, hue shade){
+            int const length(to - from + 1);
+            if(from == 0){
+               pp.plot_span(x - to, y + dy, 2*to + 1, shade);
+               if(dy) pp.plot_span(x - to, y - dy, 2*to + 1, shade);
+            }
+            else {
+               pp.plot_span(x + from, y + dy, length, shade);
+               pp.plot_span(x - to, y + dy, length, shade);
+               if(dy){
+                  pp.plot_span(x + from, y - dy, length, shade);
+                  pp.plot_span(x - to, y - dy, length, shade);
+               }
+            }
+         }
+      }
+   
+       void draw_ellipse(playpen & pp, int x, int y, int xradius, int yradius, hue shade){
+         if(xradius < 0 or yradius < 0) 
+            return;
+         ellipse_rows rows(xradius, yradius);
+         int half(rows.next());
+         for(int dy(0); dy <= yradius; ++dy){
+         // the outline is whatever the next row out does not cover, but
+         // always at least the end pixel
+            int const outer(rows.next());
+            int const from(outer + 1 < half ? outer + 1 : half);
+            mirrored_span(pp, x, y, dy, from, half, shade);
+            half = outer;
+         }
+      }
+   
+       void fill_ellipse(playpen & pp, int x, int y, int xradius, int yradius, hue shade){
+         if(xradius < 0 or yradius < 0) 
+            return;
+         ellipse_rows rows(xradius, yradius);
+         for(int dy(0); dy <= yradius; ++dy){
+            mirrored_span(pp, x, y, dy, 0, rows.next(), shade);
+         }
+      }
+   
+       void draw_circle(playpen & pp, int x, int y, int radius, hue shade){
+         draw_ellipse(pp, x, y, radius, radius, shade);
+      }
+   
+       void fill_circle(playpen & pp, int x, int y, int radius, hue shade){
+         fill_ellipse(pp, x, y, radius, radius, shade);
+      }
    
        shape read_shape(istream& in){
          shape local;
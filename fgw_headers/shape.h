@@ -2,6 +2,7 @@
 #define SHAPE_H
 #include "playpen.h"
 #include "point2d.h"
+#include <cmath>
 #include <istream>
 #include <ostream>
 #include <vector>
@@ -10,6 +11,22 @@
 
 namespace fgw {
 	typedef std::vector<point2d> shape;
+	// How the inside of a polygon whose edges cross is decided.
+	enum fill_rule {even_odd, non_zero};
+	// Fill the polygon with vertices pts[0] .. pts[n-1], the last joined
+	// back to the first (so repeating the first point at the end, as closed
+	// shapes do, makes no difference). The polygon is scanned row by row
+	// and filled with spans: a pixel is filled when its centre is inside,
+	// and a centre exactly on an edge counts as inside on the left and
+	// bottom but not on the right and top, so polygons sharing an edge
+	// neither overlap nor leave a gap. Use drawshape as well for an outline.
+	void filled_polygon(playpen & pp, point2d const * pts, int n, hue shade, fill_rule rule = even_odd);
+	void filled_polygon(playpen & pp, shape const & s, hue shade, fill_rule rule);
+	// centre is not needed now the fill does not start from a seed, and
+	// is ignored. Both fill with the even_odd rule and draw the outline
+	// with drawshape, covering the same pixels as they always have, edges
+	// included, each plotted once. As before, they do nothing for fewer
+	// than 3 points (with centre) or 4 points (without).
 	void filled_polygon(playpen & pp, shape const & s, point2d centre, hue shade);
 	void filled_polygon(playpen & pp, shape const & s, hue shade);
 	void drawshape(playpen & pp, shape const & s, hue shade);
@@ -22,6 +39,21 @@ namespace fgw {
 	double area_of_triangle(shape s);
 	shape make_regular_polygon(double radius, int n);
 	shape makecircle(double radius, point2d centre);
+	// Circles and ellipses drawn directly rather than as a shape, stepping
+	// the midpoint rule row by row: no trigonometry and nothing allocated. A pixel
+	// is inside when it is within half a pixel of the true curve, the
+	// outline is the edge of the filled version and no pixel is plotted
+	// twice. Both are drawn as horizontal spans.
+	void draw_circle(playpen & pp, int x, int y, int radius, hue shade);
+	void fill_circle(playpen & pp, int x, int y, int radius, hue shade);
+	void draw_ellipse(playpen & pp, int x, int y, int xradius, int yradius, hue shade);
+	void fill_ellipse(playpen & pp, int x, int y, int xradius, int yradius, hue shade);
+	inline void draw_circle(playpen & pp, point2d centre, double radius, hue shade){
+		draw_circle(pp, int(std::floor(centre.x()+.5)), int(std::floor(centre.y()+.5)), int(radius+.5), shade);
+	}
+	inline void fill_circle(playpen & pp, point2d centre, double radius, hue shade){
+		fill_circle(pp, int(std::floor(centre.x()+.5)), int(std::floor(centre.y()+.5)), int(radius+.5), shade);
+	}
 	shape read_shape(std::istream &);
 	void write_shape(shape const & s, std::ostream &);
 
@@ -0,0 +1,49 @@
+#include "stats_counters.h"
+#include <iostream>
+#include <stdlib.h>		// For getenv and atof.
+
+namespace studentgraphics {
+	namespace detail {
+		playpen::statistics counters = playpen::statistics();
+
+		namespace {
+			// -1 until dump_stats_every() or PLAYPEN_STATS_DUMP decide.
+			double dump_interval(-1);
+			double last_dump(0);
+		}
+
+		void DumpStatsIfDue(){
+			if(dump_interval < 0){
+				char const * env(getenv("PLAYPEN_STATS_DUMP"));
+				dump_interval = env ? atof(env) : 0;
+				last_dump = MonotonicTime();
+			}
+			if(dump_interval <= 0) return;
+			double const now(MonotonicTime());
+			if(now - last_dump < dump_interval) return;
+			last_dump = now;
+			std::cerr << "playpen stats: pixels " << counters.pixels_plotted
+				<< " clipped " << counters.pixels_clipped
+				<< " displays " << counters.display_calls
+				<< " requests " << counters.requests
+				<< " bytes " << counters.bytes_uploaded
+				<< " display " << counters.display_seconds << "s"
+				<< " palette " << counters.palette_seconds << "s"
+				<< " png encode " << counters.png_encode_seconds << "s"
+				<< " decode " << counters.png_decode_seconds << "s\n";
+		}
+	}
+
+	playpen::statistics playpen::stats(){
+		return detail::counters;
+	}
+
+	void playpen::reset_stats(){
+		detail::counters = statistics();
+	}
+
+	void playpen::dump_stats_every(double seconds){
+		detail::dump_interval = seconds;
+		detail::last_dump = MonotonicTime();
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef STATS_COUNTERS_H
+#define STATS_COUNTERS_H
+
+#include "playpen.h"
+
+// Gathering for playpen::stats(), for use inside the library only.
+// Unless PLAYPEN_STATS is defined the macros expand to nothing (the
+// sizeof keeps the compiler from warning about values only counted).
+namespace studentgraphics {
+	namespace detail {
+		extern playpen::statistics counters;
+
+		// Adds its lifetime to one of the seconds fields.
+		class stats_timer {
+		public:
+			explicit stats_timer(double playpen::statistics::* f)
+				: field(f), start(MonotonicTime()){}
+			~stats_timer(){counters.*field += MonotonicTime() - start;}
+		private:
+			stats_timer(stats_timer const &);
+			stats_timer & operator=(stats_timer const &);
+			double playpen::statistics::* field;
+			double start;
+		};
+
+		// Called by every display(); writes the counters to cerr when
+		// dump_stats_every() says it is time.
+		void DumpStatsIfDue();
+
+		// Pixels in a rectangle with all edges included, 0 if it is empty.
+		inline unsigned long RectArea(int left, int top, int right, int bottom){
+			if(left > right or top > bottom) return 0;
+			return (unsigned long)(right - left + 1) * (unsigned long)(bottom - top + 1);
+		}
+	}
+}
+
+#if defined(PLAYPEN_STATS)
+#define PLAYPEN_COUNT(field, n) \
+	(::studentgraphics::detail::counters.field += (n))
+#define PLAYPEN_TIME(field) \
+	::studentgraphics::detail::stats_timer playpen_stats_timer_( \
+		&::studentgraphics::playpen::statistics::field)
+#define PLAYPEN_DUMP_STATS() ::studentgraphics::detail::DumpStatsIfDue()
+#else
+#define PLAYPEN_COUNT(field, n) ((void)sizeof(n))
+#define PLAYPEN_TIME(field) ((void)0)
+#define PLAYPEN_DUMP_STATS() ((void)0)
+#endif
+
+#endif